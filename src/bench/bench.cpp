@@ -0,0 +1,588 @@
+﻿#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/sand/particle_simulation.hpp"
+#include "src/sand/particles.hpp"
+#include "src/sand/thermal.hpp"
+#include "src/sand/world_file.hpp"
+#include "src/sand/session_recording.hpp"
+#include "src/multi-threading/thread_pool.hpp"
+#include "src/profiler/profiler.hpp"
+
+
+// Headless throughput benchmark for ParticleSimulation.
+//
+// Usage: sand_bench [--scenario name[,name...]] [--size WxH] [--threads n[,n...]]
+//                   [--ticks n] [--warmup n] [--seed n] [--world file] [--save file]
+//                   [--replay file] [--trace file] [--thermal-coarse n]
+//
+// --world runs a saved world file instead of the scenarios, --save writes the
+// world of the first scenario right after it is set up and exits. --replay
+// times a recorded session from start to end and checks its checksums, so
+// --ticks and --warmup do not apply to it. --trace writes the newest phase
+// timings of the whole run as a Chrome trace / Perfetto file on exit, it needs a
+// build with SAND_PROFILE. --thermal-coarse sets the steps between chunk to
+// chunk heat passes of the scenarios and worlds, 0 turns the pass off.
+//
+// A thread count of 0 runs the serial update path. Results are printed to
+// stdout as one JSON document, progress goes to stderr. Besides the scenarios
+// the cost of handing one task to the thread pool is measured per thread count.
+
+
+struct Scenario {
+    std::string name;
+    sf::Vector2i default_size;
+    std::function<void(ParticleSimulation&, sf::Vector2i)> setup;
+};
+
+
+struct Options {
+    std::vector<std::string> scenarios;
+    sf::Vector2i size = { 0, 0 };
+    std::vector<std::size_t> threads;
+    int ticks = 200;
+    int warmup = 10;
+    std::uint64_t seed = 1;
+    std::string world_path;
+    std::string save_path;
+    std::string replay_path;
+    std::string trace_path;
+    std::optional<unsigned int> thermal_coarse_interval;
+};
+
+
+struct WorldLoad {
+    std::string path;
+    std::uintmax_t file_bytes;
+    double load_ns;
+};
+
+
+struct ReplayCheck {
+    std::size_t checked;
+    std::optional<std::uint32_t> first_mismatch;
+};
+
+
+struct Result {
+    std::string scenario;
+    sf::Vector2i size;
+    std::size_t threads;
+    int ticks;
+    std::uint64_t seed;
+    double total_ns;
+    double p50_ns;
+    double p99_ns;
+    std::size_t particles;
+    std::size_t active_chunks;
+    std::size_t stored_chunks;
+    std::array<std::size_t, (size_t)MaterialID::COUNT> material_histogram;
+    std::optional<ReplayCheck> replay;
+};
+
+
+static void fill_rect(ParticleSimulation& sim, sf::Vector2i min, sf::Vector2i max, MaterialID material) {
+    sim.fill_rect(min, max - sf::Vector2i(1, 1), material);
+}
+
+
+static std::vector<Scenario> make_scenarios() {
+    return {
+        {
+            "sand_pile", { 512, 512 },
+            [](ParticleSimulation& sim, sf::Vector2i size) {
+                // A wide block of sand collapsing into a pile
+                fill_rect(sim, { size.x / 4, size.y / 8 }, { 3 * size.x / 4, size.y / 2 }, MaterialID::Sand);
+            }
+        },
+        {
+            "lava_meets_water", { 512, 512 },
+            [](ParticleSimulation& sim, sf::Vector2i size) {
+                // A lava pool with a body of water dropped on top of it
+                fill_rect(sim, { 0, 3 * size.y / 4 }, size, MaterialID::Lava);
+                fill_rect(sim, { size.x / 8, size.y / 4 }, { 7 * size.x / 8, size.y / 2 }, MaterialID::Water);
+            }
+        },
+        {
+            "steam_cloud", { 512, 512 },
+            [](ParticleSimulation& sim, sf::Vector2i size) {
+                // Steam on every other cell of the whole grid, so every cell has room to move
+                for (int y = 0; y < size.y; y++) {
+                    for (int x = y & 1; x < size.x; x += 2) {
+                        sim.paint(1, { x, y }, MaterialID::Steam);
+                    }
+                }
+            }
+        },
+        {
+            "sparse_world", { 4096, 4096 },
+            [](ParticleSimulation& sim, sf::Vector2i size) {
+                // A few small piles in an otherwise empty world
+                for (int i = 1; i <= 8; i++) {
+                    const sf::Vector2i center = { size.x * i / 9, size.y / 3 };
+                    fill_rect(sim, center - sf::Vector2i(16, 16), center + sf::Vector2i(16, 16), MaterialID::Sand);
+                }
+            }
+        },
+        {
+            "vast_world", { 100000, 100000 },
+            [](ParticleSimulation& sim, sf::Vector2i size) {
+                // Falling sand and water spread over a world far too big to store densely
+                for (int i = 1; i <= 16; i++) {
+                    for (int j = 1; j <= 4; j++) {
+                        const sf::Vector2i center = { size.x * i / 17, size.y * j / 5 };
+                        const MaterialID material = (i + j) % 2 ? MaterialID::Sand : MaterialID::Water;
+                        fill_rect(sim, center - sf::Vector2i(24, 24), center + sf::Vector2i(24, 24), material);
+                    }
+                }
+            }
+        },
+    };
+}
+
+
+template <typename T>
+static std::vector<T> parse_list(const std::string& text, const std::function<T(const std::string&)>& parse) {
+    std::vector<T> values;
+    std::stringstream stream(text);
+    std::string item;
+
+    while (std::getline(stream, item, ',')) {
+        if (not item.empty()) {
+            values.push_back(parse(item));
+        }
+    }
+
+    return values;
+}
+
+
+static bool parse_options(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return false;
+        }
+
+        const std::string value = argv[++i];
+
+        if (arg == "--scenario") {
+            options.scenarios = parse_list<std::string>(value, [](const std::string& item) { return item; });
+        }
+        else if (arg == "--size") {
+            const std::size_t separator = value.find('x');
+            if (separator == std::string::npos) {
+                std::cerr << "--size expects WxH\n";
+                return false;
+            }
+            options.size = { std::atoi(value.substr(0, separator).c_str()), std::atoi(value.substr(separator + 1).c_str()) };
+        }
+        else if (arg == "--threads") {
+            options.threads = parse_list<std::size_t>(value, [](const std::string& item) { return static_cast<std::size_t>(std::atoll(item.c_str())); });
+        }
+        else if (arg == "--ticks") {
+            options.ticks = std::max(1, std::atoi(value.c_str()));
+        }
+        else if (arg == "--warmup") {
+            options.warmup = std::max(0, std::atoi(value.c_str()));
+        }
+        else if (arg == "--seed") {
+            options.seed = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--world") {
+            options.world_path = value;
+        }
+        else if (arg == "--save") {
+            options.save_path = value;
+        }
+        else if (arg == "--replay") {
+            options.replay_path = value;
+        }
+        else if (arg == "--thermal-coarse") {
+            options.thermal_coarse_interval = static_cast<unsigned int>(std::max(0, std::atoi(value.c_str())));
+        }
+        else if (arg == "--trace") {
+#ifdef SAND_PROFILE
+            options.trace_path = value;
+#else
+            std::cerr << "--trace needs a build with SAND_PROFILE\n";
+            return false;
+#endif
+        }
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+struct SchedulingResult {
+    std::size_t threads;
+    std::size_t tasks;
+    double ns_per_task;
+};
+
+
+static SchedulingResult measure_scheduling(std::size_t threads) {
+    using clock = std::chrono::steady_clock;
+
+    // Tasks that do next to nothing, so the time is all scheduling
+    const std::size_t tasks = 1 << 20;
+    const int repeats = 8;
+
+    ThreadPool pool(threads - 1);
+    std::vector<std::uint32_t> values(tasks);
+
+    auto task = [&values](std::size_t i) {
+        values[i] = static_cast<std::uint32_t>(i);
+    };
+
+    pool.parallel_for(0, tasks, 1, task);
+
+    const clock::time_point start = clock::now();
+    for (int i = 0; i < repeats; i++) {
+        pool.parallel_for(0, tasks, 1, task);
+    }
+    const double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    return { threads, tasks, ns / (static_cast<double>(tasks) * repeats) };
+}
+
+
+static double percentile(std::vector<double> samples, double fraction) {
+    std::sort(samples.begin(), samples.end());
+    const std::size_t index = static_cast<std::size_t>(fraction * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+
+static Result summarize(const std::string& name, const ParticleSimulation& sim, sf::Vector2i size, std::size_t threads, const std::vector<double>& tick_ns) {
+    Result result;
+    result.scenario = name;
+    result.size = size;
+    result.threads = threads;
+    result.ticks = static_cast<int>(tick_ns.size());
+    result.seed = sim.get_seed();
+    result.total_ns = 0;
+    for (double ns : tick_ns) {
+        result.total_ns += ns;
+    }
+    result.p50_ns = percentile(tick_ns, 0.50);
+    result.p99_ns = percentile(tick_ns, 0.99);
+    result.particles = sim.get_particle_count();
+    result.active_chunks = sim.get_active_chunk_count();
+    result.stored_chunks = sim.get_stored_chunk_count();
+    result.material_histogram = sim.get_material_histogram();
+
+    return result;
+}
+
+
+static Result measure(const std::string& name, ParticleSimulation& sim, sf::Vector2i size, std::size_t threads, const Options& options) {
+    using clock = std::chrono::steady_clock;
+
+    sim.set_multithreading(threads > 0, threads);
+
+    if (options.thermal_coarse_interval) {
+        sim.set_thermal_coarse_interval(*options.thermal_coarse_interval);
+    }
+
+    for (int i = 0; i < options.warmup; i++) {
+        sim.update();
+    }
+
+    std::vector<double> tick_ns;
+    tick_ns.reserve(options.ticks);
+
+    for (int i = 0; i < options.ticks; i++) {
+        const clock::time_point start = clock::now();
+        sim.update();
+        tick_ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count());
+    }
+
+    return summarize(name, sim, size, threads, tick_ns);
+}
+
+
+static Result run_scenario(const Scenario& scenario, sf::Vector2i size, std::size_t threads, const Options& options) {
+    ParticleSimulation sim(size, options.seed);
+    scenario.setup(sim, size);
+
+    return measure(scenario.name, sim, size, threads, options);
+}
+
+
+static Result run_world(const WorldSnapshot& world, std::size_t threads, const Options& options) {
+    ParticleSimulation sim(world);
+
+    return measure(options.world_path, sim, world.size, threads, options);
+}
+
+
+static Result run_replay(const SessionRecording& recording, std::size_t threads, const Options& options) {
+    using clock = std::chrono::steady_clock;
+
+    // Recorded edits are applied inside the timed steps, as they were when the session was played
+    std::unique_ptr<ParticleSimulation> sim = recording.create_simulation();
+    sim->set_multithreading(threads > 0, threads);
+
+    SessionReplayer replayer(recording);
+
+    std::vector<double> tick_ns;
+    tick_ns.reserve(recording.end_tick);
+
+    while (not replayer.is_finished()) {
+        const clock::time_point start = clock::now();
+        replayer.step(*sim);
+        tick_ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count());
+    }
+
+    Result result = summarize(options.replay_path, *sim, recording.size, threads, tick_ns);
+    result.replay = ReplayCheck{ replayer.get_checked_count(), replayer.get_first_mismatch() };
+
+    return result;
+}
+
+
+static bool load_world_file(const std::string& path, WorldSnapshot& world, WorldLoad& load) {
+    using clock = std::chrono::steady_clock;
+
+    const unsigned int hardware_threads = std::thread::hardware_concurrency();
+    ThreadPool pool(hardware_threads > 1 ? hardware_threads - 1 : 0);
+
+    const clock::time_point start = clock::now();
+    const bool loaded = load_world(path, world, &pool);
+
+    std::error_code error;
+    load = { path, std::filesystem::file_size(path, error), std::chrono::duration<double, std::nano>(clock::now() - start).count() };
+
+    return loaded;
+}
+
+
+static void print_json(const std::vector<Result>& results, const std::vector<SchedulingResult>& scheduling, const std::optional<WorldLoad>& world_load) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+
+    out << "{\n";
+    out << "  \"thermal_kernel\": \"" << get_thermal_kernel_name() << "\",\n";
+    out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+
+    if (world_load) {
+        out << "  \"world\": {"
+            << "\"path\": \"" << world_load->path << "\", "
+            << "\"file_bytes\": " << world_load->file_bytes << ", "
+            << "\"load_ms\": " << world_load->load_ns / 1e6
+            << "},\n";
+    }
+
+    out << "  \"results\": [\n";
+
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        const double cells = static_cast<double>(result.size.x) * result.size.y;
+        const double ns_per_tick = result.total_ns / result.ticks;
+
+        out << "    {"
+            << "\"scenario\": \"" << result.scenario << "\", "
+            << "\"width\": " << result.size.x << ", "
+            << "\"height\": " << result.size.y << ", "
+            << "\"threads\": " << result.threads << ", "
+            << "\"ticks\": " << result.ticks << ", "
+            << "\"seed\": " << result.seed << ", "
+            << "\"ns_per_tick\": " << ns_per_tick << ", "
+            << "\"cells_per_second\": " << cells * 1e9 / ns_per_tick << ", "
+            << "\"p50_tick_ns\": " << result.p50_ns << ", "
+            << "\"p99_tick_ns\": " << result.p99_ns << ", "
+            << "\"particles\": " << result.particles << ", "
+            << "\"active_chunks\": " << result.active_chunks << ", "
+            << "\"stored_chunks\": " << result.stored_chunks << ", "
+            << "\"materials\": {";
+
+        for (size_t material = 0; material < result.material_histogram.size(); material++) {
+            out << (material ? ", " : "") << "\"" << material_info.data[material].identifier << "\": " << result.material_histogram[material];
+        }
+
+        out << "}";
+
+        if (result.replay) {
+            out << ", \"checksums_checked\": " << result.replay->checked
+                << ", \"first_mismatch_tick\": ";
+
+            if (result.replay->first_mismatch) {
+                out << *result.replay->first_mismatch;
+            }
+            else {
+                out << "null";
+            }
+        }
+
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "  ],\n";
+    out << "  \"scheduling\": [\n";
+
+    for (std::size_t i = 0; i < scheduling.size(); i++) {
+        out << "    {"
+            << "\"threads\": " << scheduling[i].threads << ", "
+            << "\"tasks\": " << scheduling[i].tasks << ", "
+            << "\"ns_per_task\": " << scheduling[i].ns_per_task
+            << "}" << (i + 1 < scheduling.size() ? "," : "") << "\n";
+    }
+
+    out << "  ]\n";
+    out << "}\n";
+
+    std::cout << out.str();
+}
+
+
+int main(int argc, char** argv) {
+    register_material_behaviors();
+    register_materials();
+    register_reactions();
+
+    Options options;
+    if (not parse_options(argc, argv, options)) {
+        return 1;
+    }
+
+    const std::vector<Scenario> scenarios = make_scenarios();
+
+    if (options.scenarios.empty()) {
+        for (const Scenario& scenario : scenarios) {
+            options.scenarios.push_back(scenario.name);
+        }
+    }
+
+    if (options.threads.empty()) {
+        const unsigned int hardware_threads = std::thread::hardware_concurrency();
+        options.threads = { hardware_threads ? hardware_threads : 4 };
+    }
+
+    auto find_scenario = [&scenarios](const std::string& name) -> const Scenario* {
+        auto scenario = std::find_if(scenarios.begin(), scenarios.end(), [&](const Scenario& candidate) {
+            return candidate.name == name;
+        });
+
+        if (scenario == scenarios.end()) {
+            std::cerr << "unknown scenario " << name << "\n";
+            return nullptr;
+        }
+
+        return &*scenario;
+    };
+
+    auto get_size = [&options](const Scenario& scenario) {
+        return (options.size.x > 0 and options.size.y > 0) ? options.size : scenario.default_size;
+    };
+
+    if (not options.save_path.empty()) {
+        const Scenario* scenario = find_scenario(options.scenarios.front());
+        if (not scenario) {
+            return 1;
+        }
+
+        const sf::Vector2i size = get_size(*scenario);
+
+        ParticleSimulation sim(size, options.seed);
+        scenario->setup(sim, size);
+
+        WorldSnapshot world;
+        sim.capture(world);
+
+        if (not save_world(options.save_path, world)) {
+            std::cerr << "could not write " << options.save_path << "\n";
+            return 1;
+        }
+
+        std::cerr << "saved " << scenario->name << " " << size.x << "x" << size.y << " to " << options.save_path << "\n";
+        return 0;
+    }
+
+    std::vector<Result> results;
+    std::optional<WorldLoad> world_load;
+
+    if (not options.replay_path.empty()) {
+        SessionRecording recording;
+
+        std::string error;
+
+        if (not recording.load(options.replay_path, &error)) {
+            std::cerr << "could not load recording " << options.replay_path << ": " << error << "\n";
+            return 1;
+        }
+
+        for (std::size_t threads : options.threads) {
+            std::cerr << "replaying " << options.replay_path << " " << recording.end_tick << " ticks on " << threads << " threads\n";
+            results.push_back(run_replay(recording, threads, options));
+        }
+    }
+    else if (not options.world_path.empty()) {
+        WorldSnapshot world;
+        WorldLoad load;
+
+        if (not load_world_file(options.world_path, world, load)) {
+            std::cerr << "could not load " << options.world_path << "\n";
+            return 1;
+        }
+
+        world_load = load;
+
+        for (std::size_t threads : options.threads) {
+            std::cerr << "running " << options.world_path << " " << world.size.x << "x" << world.size.y << " on " << threads << " threads\n";
+            results.push_back(run_world(world, threads, options));
+        }
+    }
+    else {
+        for (const std::string& name : options.scenarios) {
+            const Scenario* scenario = find_scenario(name);
+            if (not scenario) {
+                return 1;
+            }
+
+            const sf::Vector2i size = get_size(*scenario);
+
+            for (std::size_t threads : options.threads) {
+                std::cerr << "running " << name << " " << size.x << "x" << size.y << " on " << threads << " threads\n";
+                results.push_back(run_scenario(*scenario, size, threads, options));
+            }
+        }
+    }
+
+    std::vector<SchedulingResult> scheduling;
+
+    for (std::size_t threads : options.threads) {
+        if (threads > 0) {
+            std::cerr << "measuring scheduling on " << threads << " threads\n";
+            scheduling.push_back(measure_scheduling(threads));
+        }
+    }
+
+    print_json(results, scheduling, world_load);
+
+#ifdef SAND_PROFILE
+    if (not options.trace_path.empty() and not write_chrome_trace(options.trace_path)) {
+        std::cerr << "could not write " << options.trace_path << "\n";
+        return 1;
+    }
+#endif
+}
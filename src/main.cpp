@@ -3,35 +3,138 @@
 #include <algorithm>
 #include <string>
 #include <sstream>
+#include <iomanip>
 #include <format>
 #include <optional>
+#include <memory>
+#include <iostream>
 
 #include "sand/particle_simulation.hpp"
 #include "sand/particles.hpp"
+#include "sand/simulation_runner.hpp"
+#include "sand/world_file.hpp"
+#include "sand/session_recording.hpp"
 #include "ui/sidebar.hpp"
 #include "viewport/viewport.hpp"
 #include "fps/fps.hpp"
+#include "profiler/profiler.hpp"
 
 
-int main() {
+int main(int argc, char** argv) {
     register_material_behaviors();
     register_materials();
+    register_reactions();
+
+    // --record <file> logs every edit of the session, --replay <file> plays one back instead of taking input
+    std::string record_path;
+    std::string replay_path;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+
+        if (arg == "--record") {
+            record_path = argv[i + 1];
+        }
+        else if (arg == "--replay") {
+            replay_path = argv[i + 1];
+        }
+    }
+
+    SessionRecording replay_recording;
+    std::optional<SessionReplayer> replayer;
+
+    if (not replay_path.empty()) {
+        std::string error;
+
+        if (not replay_recording.load(replay_path, &error)) {
+            std::cerr << "could not load recording " << replay_path << ": " << error << "\n";
+            return 1;
+        }
+
+        replayer.emplace(replay_recording);
+    }
 
     int playback_speed = 0;
 
+    // While the simulation has its own thread, playback speed sets its tick rate and the window draws at this rate
+    const unsigned int threaded_frame_limit = 60;
+
     sf::RenderWindow window(sf::VideoMode({ 640, 360 }), "Particle Sim");
-    window.setFramerateLimit(playback_speed);
 
     sf::View view;
     edit_viewport(window, view, {640, 360});
 
-    ParticleSimulation sim({64, 32});
+    std::unique_ptr<ParticleSimulation> sim_storage = replayer ? replay_recording.create_simulation() : std::make_unique<ParticleSimulation>(sf::Vector2i(64, 32));
+    ParticleSimulation& sim = *sim_storage;
+
+    // Arrow keys and dragging with the middle mouse button pan, ctrl + wheel zooms and C makes the camera follow the cursor
+    Camera& camera = sim.get_camera();
+    camera.set_view_size(view.getSize());
+
+    const float camera_pan_speed = 6.f;
+    bool follow_cursor = false;
+
+    std::optional<SessionRecorder> recorder;
+
+    if (not record_path.empty()) {
+        recorder.emplace(sim);
+    }
+
+    // T switches between ticking on a separate thread and ticking once per frame.
+    // A replay always ticks once per frame
+    SimulationRunner runner(sim);
+    bool threaded = not replayer;
+
+    if (threaded) {
+        runner.set_recorder(recorder ? &*recorder : nullptr);
+        runner.set_tick_rate(playback_speed);
+        runner.start();
+        window.setFramerateLimit(threaded_frame_limit);
+    }
+    else {
+        window.setFramerateLimit(playback_speed);
+    }
+
+    // Does what the simulation thread does with a command, for when it is not running
+    auto apply_command = [&](const SimulationCommand& command) {
+        if (threaded) {
+            runner.push(command);
+            return;
+        }
+
+        if (recorder) {
+            recorder->record(sim, command);
+        }
+
+        if (command.type == SimulationCommand::Type::Paint) {
+            sim.paint(command.brush_size, command.cell, command.material);
+        }
+        else if (command.type == SimulationCommand::Type::Line) {
+            sim.fill_line(command.from, command.cell, command.brush_size, command.material);
+        }
+        else if (command.type == SimulationCommand::Type::Step) {
+            sim.update();
+
+            if (recorder) {
+                recorder->on_step(sim);
+            }
+        }
+    };
+
     Sidebar sidebar({ MaterialID::Sand, MaterialID::Rock, MaterialID::Water, MaterialID::Steam }, { sf::Color(255, 255, 0), sf::Color(128, 128, 128), sf::Color(0, 128, 255), sf::Color::Green });
 
     int brush_size = 5;
 
+    // The cell painted on the last frame while a mouse button is held, strokes are
+    // painted as lines from it so a fast cursor leaves no gaps
+    std::optional<sf::Vector2i> last_painted_cell;
+
     sf::Vector2i mouse_pos;
 
+    // The mouse in view coordinates, which is what the simulation and the camera work in
+    sf::Vector2i cursor;
+    sf::Vector2i last_cursor;
+
     sf::Font arial("fonts/Arial.ttf");
 
     sf::Text general_info(arial, "", 15U);
@@ -43,12 +146,29 @@ int main() {
     bool paused = false;
     std::string paused_info = "\n";
 
-    std::string display_mode_info = "standard";
+    DisplayMode display_mode = DisplayMode::Standard;
+
+    // S writes the world here, sand_bench --world can run it without a window
+    const std::string world_path = "world.sand";
+    bool save_failed = false;
 
     FpsCounter counter;
 
+#ifdef SAND_PROFILE
+    // Per phase cost over the last second, P writes everything the profiler still holds to trace_path
+    const std::string trace_path = "trace.json";
+    std::string trace_info;
+
+    sf::Text profile_info(arial, "", 11U);
+    profile_info.setPosition(sf::Vector2f(15, 15));
+#endif
+
     while (window.isOpen()) {
+        PROFILE_SCOPE("frame");
+
         mouse_pos = sf::Mouse::getPosition(window);
+        last_cursor = cursor;
+        cursor = sf::Vector2i(window.mapPixelToCoords(mouse_pos));
         int fps = counter.update();
 
         // Handle input
@@ -62,7 +182,12 @@ int main() {
             }
 
             if (const auto* mouseWheelScrolled = event->getIf<sf::Event::MouseWheelScrolled>()) {
-                if (mouseWheelScrolled->wheel == sf::Mouse::Wheel::Vertical) {
+                const bool control = sf::Keyboard::isKeyPressed(sf::Keyboard::Key::LControl) or sf::Keyboard::isKeyPressed(sf::Keyboard::Key::RControl);
+
+                if (mouseWheelScrolled->wheel == sf::Mouse::Wheel::Vertical and control) {
+                    camera.zoom(mouseWheelScrolled->delta > 0 ? 1 : -1, sf::Vector2f(cursor));
+                }
+                else if (mouseWheelScrolled->wheel == sf::Mouse::Wheel::Vertical) {
                     if (mouseWheelScrolled->delta > 0) {
                         brush_size = std::min(brush_size + 1, 50);
                     }
@@ -75,7 +200,13 @@ int main() {
             if (const auto* textEntered = event->getIf<sf::Event::TextEntered>()) {
                 if (textEntered->unicode >= 48 and textEntered->unicode <= 57) { // 1 - 9
                     playback_speed = 15 * (textEntered->unicode - 48);
-                    window.setFramerateLimit(playback_speed);
+
+                    if (threaded) {
+                        runner.set_tick_rate(playback_speed);
+                    }
+                    else {
+                        window.setFramerateLimit(playback_speed);
+                    }
                 }
             }
 
@@ -84,11 +215,59 @@ int main() {
                     paused = !paused;
 
                     paused_info = (paused) ? "paused\n" : "\n";
+
+                    apply_command({ paused ? SimulationCommand::Type::Pause : SimulationCommand::Type::Resume });
                 }
 
                 if (keyPressed->code == sf::Keyboard::Key::F && paused) {
-                    sim.update();
+                    if (replayer) {
+                        replayer->step(sim);
+                    }
+                    else {
+                        apply_command({ SimulationCommand::Type::Step });
+                    }
+                }
+
+                if (keyPressed->code == sf::Keyboard::Key::S) {
+                    if (threaded) {
+                        runner.save(world_path);
+                    }
+                    else {
+                        WorldSnapshot world;
+                        sim.capture(world);
+                        save_failed = not save_world(world_path, world);
+                    }
+                }
+
+                if (keyPressed->code == sf::Keyboard::Key::T and not replayer) {
+                    threaded = !threaded;
+
+                    if (threaded) {
+                        // Queued before the thread starts so it never runs a tick the window did not want
+                        runner.push({ paused ? SimulationCommand::Type::Pause : SimulationCommand::Type::Resume });
+                        runner.set_tick_rate(playback_speed);
+                        runner.start();
+                        window.setFramerateLimit(threaded_frame_limit);
+                    }
+                    else {
+                        runner.stop();
+                        window.setFramerateLimit(playback_speed);
+                    }
+                }
+
+                if (keyPressed->code == sf::Keyboard::Key::V) {
+                    display_mode = next_display_mode(display_mode);
+                }
+
+                if (keyPressed->code == sf::Keyboard::Key::C) {
+                    follow_cursor = !follow_cursor;
+                }
+
+#ifdef SAND_PROFILE
+                if (keyPressed->code == sf::Keyboard::Key::P) {
+                    trace_info = write_chrome_trace(trace_path) ? "wrote " + trace_path : "writing " + trace_path + " failed";
                 }
+#endif
 
                 if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Escape)) {
                     break;
@@ -96,51 +275,169 @@ int main() {
             }
         }
 
+        sf::Vector2f camera_pan;
+
+        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Left)) {
+            camera_pan.x -= camera_pan_speed;
+        }
+        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Right)) {
+            camera_pan.x += camera_pan_speed;
+        }
+        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Up)) {
+            camera_pan.y -= camera_pan_speed;
+        }
+        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Down)) {
+            camera_pan.y += camera_pan_speed;
+        }
+
+        if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Middle)) {
+            camera_pan += sf::Vector2f(last_cursor - cursor);
+        }
+
+        camera.pan(camera_pan);
+
+        if (follow_cursor) {
+            camera.follow(sf::Vector2f(cursor), 0.1f);
+        }
+
+        std::optional<MaterialID> brush_material;
+
         if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Left)) {
-            sim.brush(brush_size, mouse_pos, sidebar.get_selected_of_index());
+            brush_material = sidebar.get_selected_of_index();
         }
 
         if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Right)) {
-            sim.brush(brush_size, mouse_pos, MaterialID::Air);
+            brush_material = MaterialID::Air;
+        }
+
+        if (brush_material and not replayer) {
+            const std::optional<sf::Vector2i> cell = sim.get_cell_at(cursor);
+
+            if (cell and last_painted_cell) {
+                apply_command({ SimulationCommand::Type::Line, brush_size, *cell, *brush_material, *last_painted_cell });
+            }
+            else if (cell) {
+                apply_command({ SimulationCommand::Type::Paint, brush_size, *cell, *brush_material });
+            }
+
+            last_painted_cell = cell;
+        }
+        else {
+            last_painted_cell.reset();
         }
 
-        if (!paused) {
+        if (!paused and replayer) {
+            replayer->step(sim);
+        }
+        else if (!paused and !threaded) {
             sim.update();
+
+            if (recorder) {
+                recorder->on_step(sim);
+            }
         }
 
+        // The newest tick the simulation thread finished, the simulation itself may be mid tick
+        const WorldSnapshot* snapshot = threaded ? &runner.get_snapshot() : nullptr;
+
         // Update ui
-        std::ostringstream general_info_str;
-        general_info_str << paused_info
-            << "selected element: " << materials[sidebar.get_selected_of_index()].identifier
-            << "\ndisplay mode: " << display_mode_info
-            << "\nFPS: " << fps << "/" << playback_speed
-            << "\nParticles: " << sim.get_particle_count();
+        {
+            PROFILE_SCOPE("ui_text");
+
+            std::ostringstream general_info_str;
+            general_info_str << paused_info
+                << "selected element: " << material_info[sidebar.get_selected_of_index()].identifier
+                << "\ndisplay mode: " << get_display_mode_name(display_mode)
+                << "\nFPS: " << fps << "/" << playback_speed;
+
+            if (threaded) {
+                general_info_str << "\nTPS: " << static_cast<int>(runner.get_ticks_per_second())
+                    << "\nParticles: " << snapshot->particle_count;
+            }
+            else {
+                general_info_str << "\nParticles: " << sim.get_particle_count();
+            }
+
+            if (replayer) {
+                general_info_str << "\nreplay: tick " << sim.get_tick() << "/" << replay_recording.end_tick;
+
+                if (const std::optional<std::uint32_t> mismatch = replayer->get_first_mismatch()) {
+                    general_info_str << ", diverged at tick " << *mismatch;
+                }
+                else if (replayer->is_finished()) {
+                    general_info_str << ", all " << replayer->get_checked_count() << " checksums match";
+                }
+            }
+
+            if (threaded and runner.is_saving()) {
+                general_info_str << "\nsaving " << world_path;
+            }
+            else if (threaded ? runner.did_last_save_fail() : save_failed) {
+                general_info_str << "\nsaving " << world_path << " failed";
+            }
+
+            general_info.setString(general_info_str.str());
 
-        general_info.setString(general_info_str.str());
+            ParticleInformation info = threaded ? sim.get_particle_information(cursor, *snapshot) : sim.get_particle_information(cursor);
 
-        ParticleInformation info = sim.get_particle_information(mouse_pos);
+            if (info.valid_particle) {
+                std::ostringstream particle_info_str;
+                particle_info_str << info.material_name << "\n"
+                << info.behavior_name << "\n"
+                << info.temp << "c\n";
+                particle_info.setString(particle_info_str.str());
+            }
+            else {
+                particle_info.setString("");
+            }
+
+#ifdef SAND_PROFILE
+            std::ostringstream profile_info_str;
+            for (const PhaseTime& phase : get_phase_times(1.0)) {
+                profile_info_str << std::left << std::setw(18) << phase.name << std::right << std::fixed << std::setprecision(2)
+                    << std::setw(7) << phase.average_ms << " ms x" << phase.count << "\n";
+            }
+            profile_info_str << trace_info;
+            profile_info.setString(profile_info_str.str());
+#endif
+        }
+
+        window.clear();
 
-        if (info.valid_particle) {
-            std::ostringstream particle_info_str;
-            particle_info_str << info.material_name << "\n"
-            << info.behavior_name << "\n"
-            << info.temp << "c\n";
-            particle_info.setString(particle_info_str.str());
+        if (threaded) {
+            sim.draw_sfml(window, *snapshot, display_mode);
         }
         else {
-            particle_info.setString("");
+            sim.draw_sfml(window, display_mode);
         }
+        sim.draw_brush_outline_sfml(window, brush_size, cursor);
 
-        window.clear();
+        {
+            PROFILE_SCOPE("draw_ui");
 
-        sim.draw_sfml(window, false);
-        sim.draw_brush_outline_sfml(window, brush_size, mouse_pos);
+            sidebar.draw_sfml(window);
 
-        sidebar.draw_sfml(window);
+            window.draw(particle_info);
+            window.draw(general_info);
 
-        window.draw(particle_info);
-        window.draw(general_info);
+#ifdef SAND_PROFILE
+            window.draw(profile_info);
+#endif
+        }
 
-        window.display();
+        {
+            PROFILE_SCOPE("display");
+            window.display();
+        }
+    }
+
+    if (recorder) {
+        // The simulation thread has to be done with the recorder before it is finished
+        runner.stop();
+
+        if (not recorder->finish(sim).save(record_path)) {
+            std::cerr << "could not save recording " << record_path << "\n";
+            return 1;
+        }
     }
 }
\ No newline at end of file
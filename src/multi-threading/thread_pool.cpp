@@ -1,74 +1,206 @@
-#include <SFML/System/Vector2.hpp>
-
-#include <iostream>
 #include <vector>
 #include <thread>
-#include <queue>
-#include <functional>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "thread_pool.hpp"
 
 
-ThreadPool::ThreadPool(size_t thread_count) : stop(false) {
+static constexpr std::uint64_t closed_flag = std::uint64_t(1) << 31;
+static constexpr std::uint64_t member_mask = closed_flag - 1;
+
+
+static std::uint64_t pack_grains(std::uint32_t first, std::uint32_t last) {
+    return (static_cast<std::uint64_t>(first) << 32) | last;
+}
+
+
+static void pin_to_cpu(std::thread& thread, size_t cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+
+ThreadPool::ThreadPool(size_t thread_count, bool pin_threads) : participant_count(thread_count + 1), blocks(std::make_unique<Block[]>(thread_count + 1)) {
+    const size_t cpu_count = std::max(1u, std::thread::hardware_concurrency());
+
     for (size_t i = 0; i < thread_count; ++i) {
-        workers.emplace_back([this] {
-           while (true) {
-                std::function<void()> task;
+        workers.emplace_back([this, i] {
+            worker_loop(i);
+        });
+
+        if (pin_threads) {
+            pin_to_cpu(workers.back(), (i + 1) % cpu_count);
+        }
+    }
+}
+
+
+ThreadPool::~ThreadPool() {
+    stop.store(true, std::memory_order_release);
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+
+size_t ThreadPool::get_thread_count() const {
+    return workers.size();
+}
+
+
+void ThreadPool::run(RangeFunction function, void* context, size_t begin, size_t end, size_t grain) {
+    job_function = function;
+    job_context = context;
+    job_begin = begin;
+    job_end = end;
+    job_grain = grain;
+
+    // Every participant starts with an even share of the grains
+    const size_t grain_count = (end - begin + grain - 1) / grain;
+
+    for (size_t i = 0; i < participant_count; i++) {
+        const std::uint32_t first = static_cast<std::uint32_t>(grain_count * i / participant_count);
+        const std::uint32_t last = static_cast<std::uint32_t>(grain_count * (i + 1) / participant_count);
+        blocks[i].grains.store(pack_grains(first, last), std::memory_order_relaxed);
+    }
+
+    const std::uint32_t next_generation = generation.load(std::memory_order_relaxed) + 1;
 
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    cv.wait(lock, [this] { return stop || !tasks.empty(); });
+    job_state.store(static_cast<std::uint64_t>(next_generation) << 32, std::memory_order_release);
+    generation.store(next_generation, std::memory_order_release);
+    generation.notify_all();
 
-                    if (stop && tasks.empty())
-                        return;
+    work(participant_count - 1);
 
-                    task = std::move(tasks.front());
-                    tasks.pop();
+    // Nothing is left to take, so late workers are turned away and the ones
+    // still finishing their last grain are waited for
+    job_state.fetch_or(closed_flag, std::memory_order_acq_rel);
+
+    while (job_state.load(std::memory_order_acquire) & member_mask) {
+        std::this_thread::yield();
+    }
+}
 
-                    active_workers++;
-                }
 
-                task();
+void ThreadPool::work(size_t participant) {
+    std::uint32_t grain_index;
 
-                active_workers--;
-                cv.notify_all();
+    // A stolen block can be stolen again before its first grain is taken, so
+    // only a steal that finds every block empty ends the loop
+    while (true) {
+        if (not take_grain(participant, grain_index)) {
+            if (steal(participant)) {
+                continue;
             }
-        });
+            return;
+        }
+
+        const size_t first = job_begin + grain_index * job_grain;
+        const size_t last = std::min(job_end, first + job_grain);
+
+        job_function(job_context, first, last);
     }
 }
 
 
-void ThreadPool::enqueue(std::function<void()> task) {
-    {
-        if (stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+bool ThreadPool::take_grain(size_t participant, std::uint32_t& grain_index) {
+    std::atomic<std::uint64_t>& grains = blocks[participant].grains;
+    std::uint64_t current = grains.load(std::memory_order_relaxed);
 
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push(std::move(task));
+    while (true) {
+        const std::uint32_t first = static_cast<std::uint32_t>(current >> 32);
+        const std::uint32_t last = static_cast<std::uint32_t>(current);
+
+        if (first >= last) {
+            return false;
+        }
+
+        if (grains.compare_exchange_weak(current, pack_grains(first + 1, last), std::memory_order_relaxed)) {
+            grain_index = first;
+            return true;
+        }
     }
-    cv.notify_one();
 }
 
 
-void ThreadPool::wait_until_idle() {
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    cv.wait(lock, [this] {
-        return tasks.empty() && active_workers.load() == 0;
-    });
+bool ThreadPool::steal(size_t participant) {
+    for (size_t offset = 1; offset < participant_count; offset++) {
+        std::atomic<std::uint64_t>& victim = blocks[(participant + offset) % participant_count].grains;
+        std::uint64_t current = victim.load(std::memory_order_relaxed);
+
+        while (true) {
+            const std::uint32_t first = static_cast<std::uint32_t>(current >> 32);
+            const std::uint32_t last = static_cast<std::uint32_t>(current);
+
+            if (first >= last) {
+                break;
+            }
+
+            // The back half moves over, a single grain left is taken whole
+            const std::uint32_t middle = first + (last - first) / 2;
+
+            if (victim.compare_exchange_weak(current, pack_grains(first, middle), std::memory_order_relaxed)) {
+                // Grains never return to a block once taken, so no thief can be
+                // holding a stale copy of this value when it is written
+                blocks[participant].grains.store(pack_grains(middle, last), std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    return false;
 }
 
 
-ThreadPool::~ThreadPool() {
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+bool ThreadPool::join(std::uint32_t job_generation) {
+    std::uint64_t state = job_state.load(std::memory_order_acquire);
+
+    while (true) {
+        if (static_cast<std::uint32_t>(state >> 32) != job_generation or (state & closed_flag)) {
+            return false;
+        }
+
+        if (job_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+            return true;
+        }
     }
-    cv.notify_all();
+}
 
-    for (std::thread &worker : workers) {
-        worker.join();
+
+void ThreadPool::worker_loop(size_t participant) {
+    std::uint32_t seen_generation = 0;
+
+    while (true) {
+        // Jobs usually come in bursts, so look again a few times before sleeping
+        for (int spin = 0; spin < 64 and generation.load(std::memory_order_acquire) == seen_generation; spin++) {
+            std::this_thread::yield();
+        }
+
+        generation.wait(seen_generation, std::memory_order_acquire);
+        seen_generation = generation.load(std::memory_order_acquire);
+
+        if (stop.load(std::memory_order_acquire)) {
+            return;
+        }
+
+        if (join(seen_generation)) {
+            work(participant);
+            job_state.fetch_sub(1, std::memory_order_release);
+        }
     }
-}
\ No newline at end of file
+}
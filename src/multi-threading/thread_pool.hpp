@@ -1,32 +1,107 @@
-#include <SFML/System/Vector2.hpp>
+#pragma once
 
-#include <iostream>
 #include <vector>
 #include <thread>
-#include <queue>
-#include <functional>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
 
 
+// Fork/join pool for loops over many small tasks.
+//
+// parallel_for splits a range into grains and hands every participant (the
+// workers plus the calling thread) one contiguous block of them. Each
+// participant takes grains from the front of its own block and, once it runs
+// dry, steals the back half of someone else's. Blocks are single atomic words,
+// so neither taking nor stealing ever locks, and sleeping workers are woken
+// through atomic wait/notify instead of a mutex and condition variable.
 class ThreadPool {
 public:
-    ThreadPool(size_t thread_count);
+    // pin_threads binds worker i to cpu i + 1, the calling thread is left alone
+    ThreadPool(size_t thread_count, bool pin_threads = false);
 
-    void enqueue(std::function<void()> task);
+    ~ThreadPool();
 
-    void wait_until_idle();
+    // Calls function(i) for every i in [begin, end), grain indices at a time.
+    // The calling thread takes part and the call returns once every index is
+    // done. Only one thread may call it at a time and function must not throw
+    template <typename Function>
+    void parallel_for(size_t begin, size_t end, size_t grain, Function&& function);
 
-    ~ThreadPool();
+    size_t get_thread_count() const;
 
 private:
-    std::atomic<size_t> active_workers{0};
+    using RangeFunction = void (*)(void* context, size_t begin, size_t end);
+
+    // A block of grains [first, last) packed into one word so it can be split with a single CAS
+    struct alignas(64) Block {
+        std::atomic<std::uint64_t> grains{0};
+    };
+
+    void run(RangeFunction function, void* context, size_t begin, size_t end, size_t grain);
+
+    void work(size_t participant);
+
+    bool take_grain(size_t participant, std::uint32_t& grain_index);
+
+    bool steal(size_t participant);
+
+    bool join(std::uint32_t generation);
+
+    void worker_loop(size_t participant);
+
+    // The workers plus the calling thread
+    const size_t participant_count;
 
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
 
-    std::mutex queue_mutex;
-    std::condition_variable cv;
-    bool stop;
-};
\ No newline at end of file
+    // One block per worker and a last one for the calling thread
+    std::unique_ptr<Block[]> blocks;
+
+    // The job being run, written before generation is bumped
+    RangeFunction job_function = nullptr;
+    void* job_context = nullptr;
+    size_t job_begin = 0;
+    size_t job_end = 0;
+    size_t job_grain = 1;
+
+    // Bumped for every job, workers sleep on it between jobs
+    std::atomic<std::uint32_t> generation{0};
+
+    // generation << 32 | closed flag | workers inside the job
+    std::atomic<std::uint64_t> job_state{0};
+
+    std::atomic<bool> stop{false};
+};
+
+
+template <typename Function>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, Function&& function) {
+    if (begin >= end) {
+        return;
+    }
+
+    grain = std::max<size_t>(grain, 1);
+
+    if (workers.empty() or end - begin <= grain) {
+        for (size_t i = begin; i < end; i++) {
+            function(i);
+        }
+        return;
+    }
+
+    using FunctionType = std::remove_reference_t<Function>;
+
+    // Type erased through a plain function pointer so nothing is allocated per call
+    RangeFunction range_function = [](void* context, size_t first, size_t last) {
+        FunctionType& callable = *static_cast<FunctionType*>(context);
+
+        for (size_t i = first; i < last; i++) {
+            callable(i);
+        }
+    };
+
+    run(range_function, const_cast<void*>(static_cast<const void*>(std::addressof(function))), begin, end, grain);
+}
@@ -0,0 +1,206 @@
+﻿#include "profiler.hpp"
+
+#ifdef SAND_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+
+static constexpr std::size_t ring_capacity = std::size_t(1) << 16;
+static constexpr std::uint64_t ring_mask = ring_capacity - 1;
+
+
+// Fields are relaxed atomics so a reader racing the owning thread gets stale
+// values instead of undefined behavior, stores to them are plain moves on x86
+struct ProfileEvent {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<std::uint64_t> begin{0};
+    std::atomic<std::uint64_t> end{0};
+};
+
+
+struct ProfileBuffer {
+    std::uint32_t thread_index = 0;
+
+    // Events ever recorded, event i lives in events[i & ring_mask] until overwritten
+    std::atomic<std::uint64_t> written{0};
+
+    std::unique_ptr<ProfileEvent[]> events = std::make_unique<ProfileEvent[]>(ring_capacity);
+};
+
+
+struct CopiedEvent {
+    const char* name;
+    std::uint64_t begin;
+    std::uint64_t end;
+    std::uint32_t thread_index;
+};
+
+
+// Buffers are never freed, threads that are gone leave their last events behind for the trace
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<ProfileBuffer>> buffers;
+
+static thread_local ProfileBuffer* local_buffer = nullptr;
+
+
+static ProfileBuffer& get_local_buffer() {
+    if (not local_buffer) {
+        std::lock_guard lock(buffers_mutex);
+
+        buffers.push_back(std::make_unique<ProfileBuffer>());
+        local_buffer = buffers.back().get();
+        local_buffer->thread_index = static_cast<std::uint32_t>(buffers.size() - 1);
+    }
+
+    return *local_buffer;
+}
+
+
+// Copies the newest events of a buffer, walking back until one ended before
+// cutoff. Once copied, events the owner may have overwritten meanwhile are dropped
+static void copy_events(const ProfileBuffer& buffer, std::uint64_t cutoff, std::vector<CopiedEvent>& out) {
+    const std::uint64_t written = buffer.written.load(std::memory_order_acquire);
+    const std::uint64_t oldest = written > ring_capacity ? written - ring_capacity : 0;
+    const std::size_t first_copied = out.size();
+
+    std::uint64_t i = written;
+    while (i > oldest) {
+        i--;
+        const ProfileEvent& event = buffer.events[i & ring_mask];
+        const std::uint64_t end = event.end.load(std::memory_order_relaxed);
+
+        if (end < cutoff) {
+            break;
+        }
+
+        out.push_back({ event.name.load(std::memory_order_relaxed), event.begin.load(std::memory_order_relaxed), end, buffer.thread_index });
+    }
+
+    // The owner may be writing event written_after right now, which shares its slot
+    // with written_after - ring_capacity, so that one is dropped as well
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const std::uint64_t written_after = buffer.written.load(std::memory_order_relaxed);
+    const std::uint64_t safe_oldest = written_after >= ring_capacity ? written_after - ring_capacity + 1 : 0;
+
+    // Copies were made newest first, so the overwritten ones are at the back. A
+    // buffer that went all the way around while being copied keeps none
+    const std::uint64_t kept_oldest = std::max(i, safe_oldest);
+    const std::size_t valid = kept_oldest < written ? static_cast<std::size_t>(written - kept_oldest) : 0;
+    out.resize(first_copied + std::min(valid, out.size() - first_copied));
+}
+
+
+static std::vector<CopiedEvent> copy_all_events(std::uint64_t cutoff) {
+    std::vector<CopiedEvent> events;
+    std::lock_guard lock(buffers_mutex);
+
+    for (const std::unique_ptr<ProfileBuffer>& buffer : buffers) {
+        copy_events(*buffer, cutoff, events);
+    }
+
+    return events;
+}
+
+
+static void write_json_string(std::ostream& out, const char* text) {
+    out << '"';
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' or *c == '\\') {
+            out << '\\';
+        }
+        out << *c;
+    }
+    out << '"';
+}
+
+
+std::uint64_t get_profile_time() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+void record_profile_event(const char* name, std::uint64_t begin, std::uint64_t end) {
+    ProfileBuffer& buffer = get_local_buffer();
+
+    // Only this thread writes the buffer, the release publishes the event to readers.
+    // The fence orders the last publish before the overwrite, so a reader that saw any
+    // of the new fields also sees written at least at index and drops the slot
+    const std::uint64_t index = buffer.written.load(std::memory_order_relaxed);
+    ProfileEvent& event = buffer.events[index & ring_mask];
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    event.name.store(name, std::memory_order_relaxed);
+    event.begin.store(begin, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+
+    buffer.written.store(index + 1, std::memory_order_release);
+}
+
+
+std::vector<PhaseTime> get_phase_times(double window_seconds) {
+    const std::uint64_t now = get_profile_time();
+    const std::uint64_t window = static_cast<std::uint64_t>(window_seconds * 1e9);
+    const std::vector<CopiedEvent> events = copy_all_events(now > window ? now - window : 0);
+
+    // The same literal can have a different address in every translation unit, so names are compared as text
+    std::map<std::string, PhaseTime> phases;
+
+    for (const CopiedEvent& event : events) {
+        PhaseTime& phase = phases[event.name];
+        phase.total_ms += static_cast<double>(event.end - event.begin) / 1e6;
+        phase.count++;
+    }
+
+    std::vector<PhaseTime> result;
+    result.reserve(phases.size());
+
+    for (auto& [name, phase] : phases) {
+        phase.name = name;
+        phase.average_ms = phase.total_ms / phase.count;
+        result.push_back(phase);
+    }
+
+    return result;
+}
+
+
+bool write_chrome_trace(const std::string& path) {
+    std::vector<CopiedEvent> events = copy_all_events(0);
+
+    std::sort(events.begin(), events.end(), [](const CopiedEvent& a, const CopiedEvent& b) {
+        return a.begin < b.begin;
+    });
+
+    const std::uint64_t origin = events.empty() ? 0 : events.front().begin;
+
+    std::ofstream out(path);
+    if (not out) {
+        return false;
+    }
+
+    // Complete events ("ph": "X") with times in microseconds, one track per recording thread
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const CopiedEvent& event = events[i];
+
+        out << (i ? ",\n" : "") << "{\"name\": ";
+        write_json_string(out, event.name);
+        out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread_index
+            << ", \"ts\": " << static_cast<double>(event.begin - origin) / 1e3
+            << ", \"dur\": " << static_cast<double>(event.end - event.begin) / 1e3 << "}";
+    }
+
+    out << "\n]}\n";
+
+    return static_cast<bool>(out);
+}
+
+#endif
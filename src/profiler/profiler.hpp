@@ -0,0 +1,73 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Scoped timers for the simulation phases and render stages.
+//
+// Only built in when SAND_PROFILE is defined (cmake -DSAND_PROFILE=ON). Without it
+// PROFILE_SCOPE expands to nothing and none of the functions below exist, so
+// callers outside of a scope guard their uses with #ifdef SAND_PROFILE.
+//
+// Every thread records into a ring buffer of its own, so recording never locks
+// and never waits on a reader. Readers copy what they need while the buffers keep
+// filling and drop whatever was overwritten under them.
+#ifdef SAND_PROFILE
+
+#define SAND_PROFILE_CONCAT_INNER(a, b) a##b
+#define SAND_PROFILE_CONCAT(a, b) SAND_PROFILE_CONCAT_INNER(a, b)
+
+// Times the rest of the enclosing block, name must be a string literal
+#define PROFILE_SCOPE(name) ProfileScope SAND_PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+
+// What one named scope cost over the window get_phase_times looked at
+struct PhaseTime {
+    std::string name;
+    double total_ms = 0.0;
+    double average_ms = 0.0;
+    std::uint32_t count = 0;
+};
+
+
+// Nanoseconds on a steady clock
+std::uint64_t get_profile_time();
+
+void record_profile_event(const char* name, std::uint64_t begin, std::uint64_t end);
+
+//////////////////////////////////////////////////////////////////////////////////////
+// \brief Sums up every scope that ended in the last window_seconds, sorted by name 
+// Scopes running on several threads at once add up, so a total can exceed the window 
+//////////////////////////////////////////////////////////////////////////////////////
+std::vector<PhaseTime> get_phase_times(double window_seconds);
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Writes every scope still held by the ring buffers as a Chrome trace / Perfetto file 
+// \return Whether the file could be written                                                  
+///////////////////////////////////////////////////////////////////////////////////////////////
+bool write_chrome_trace(const std::string& path);
+
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name) : name(name), begin(get_profile_time()) {}
+
+    ~ProfileScope() {
+        record_profile_event(name, begin, get_profile_time());
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    const char* name;
+    std::uint64_t begin;
+};
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+#endif
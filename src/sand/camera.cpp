@@ -0,0 +1,133 @@
+﻿#include <algorithm>
+#include <cmath>
+
+#include "camera.hpp"
+
+
+static float clamp_axis(float position, float world, float view, float pixels_per_cell) {
+    const float margin = std::min(view / 2.f, world);
+    position = std::clamp(position, margin - view, world - margin);
+
+    // Whole pixels only, so cell borders never fall between two pixels
+    return std::round(position * pixels_per_cell) / pixels_per_cell;
+}
+
+
+Camera::Camera(sf::Vector2i world_size) : world_size(world_size) {}
+
+
+void Camera::set_view_size(sf::Vector2f size) {
+    view_size = size;
+    level = std::min(level, get_max_level());
+    clamp_origin();
+}
+
+
+void Camera::pan(sf::Vector2f offset) {
+    origin += offset / get_pixels_per_cell();
+    clamp_origin();
+}
+
+
+void Camera::zoom(int steps, sf::Vector2f anchor) {
+    const sf::Vector2f anchor_cell = view_to_world(anchor);
+
+    for (int i = 0; i < std::abs(steps); i++) {
+        if (steps > 0 and level > 0) {
+            level--;
+        }
+        else if (steps < 0 and cell_stride == min_cell_stride) {
+            level = std::min(level + 1, get_max_level());
+        }
+        else {
+            // At least one pixel per step, otherwise the small strides would never change
+            const int change = std::max(1, cell_stride / 4);
+            cell_stride = std::clamp(steps > 0 ? cell_stride + change : cell_stride - change, min_cell_stride, max_cell_stride);
+        }
+    }
+
+    origin = anchor_cell - anchor / get_pixels_per_cell();
+    clamp_origin();
+}
+
+
+void Camera::follow(sf::Vector2f target, float rate) {
+    const sf::Vector2f quarter = view_size / 4.f;
+    const sf::Vector2f center = view_size / 2.f;
+
+    // Only the part of the distance that reaches past the middle half counts
+    sf::Vector2f distance;
+    distance.x = std::max(0.f, std::abs(target.x - center.x) - quarter.x) * (target.x < center.x ? -1.f : 1.f);
+    distance.y = std::max(0.f, std::abs(target.y - center.y) - quarter.y) * (target.y < center.y ? -1.f : 1.f);
+
+    pan(distance * rate);
+}
+
+
+sf::Vector2f Camera::view_to_world(sf::Vector2f position) const {
+    return origin + position / get_pixels_per_cell();
+}
+
+
+sf::Vector2f Camera::world_to_view(sf::Vector2f position) const {
+    return (position - origin) * get_pixels_per_cell();
+}
+
+
+sf::IntRect Camera::get_visible_cells() const {
+    const sf::Vector2f end = view_to_world(view_size);
+
+    const sf::Vector2i min = {
+        std::clamp(static_cast<int>(std::floor(origin.x)), 0, world_size.x),
+        std::clamp(static_cast<int>(std::floor(origin.y)), 0, world_size.y)
+    };
+
+    const sf::Vector2i max = {
+        std::clamp(static_cast<int>(std::ceil(end.x)), 0, world_size.x),
+        std::clamp(static_cast<int>(std::ceil(end.y)), 0, world_size.y)
+    };
+
+    return sf::IntRect(min, max - min);
+}
+
+
+int Camera::get_cell_stride() const {
+    return cell_stride;
+}
+
+
+int Camera::get_level() const {
+    return level;
+}
+
+
+int Camera::get_gap() const {
+    // Below this a one pixel gap would hide most of every cell
+    return cell_stride >= 4 ? 1 : 0;
+}
+
+
+float Camera::get_pixels_per_cell() const {
+    return static_cast<float>(cell_stride) / static_cast<float>(1 << level);
+}
+
+
+int Camera::get_max_level() const {
+    // Zooming out stops once the whole world fits into the view
+    int max_level = 0;
+
+    while ((world_size.x >> max_level) > view_size.x or (world_size.y >> max_level) > view_size.y) {
+        max_level++;
+    }
+
+    return max_level;
+}
+
+
+void Camera::clamp_origin() {
+    const float pixels_per_cell = get_pixels_per_cell();
+    const sf::Vector2f view_cells = view_size / pixels_per_cell;
+
+    origin.x = clamp_axis(origin.x, static_cast<float>(world_size.x), view_cells.x, pixels_per_cell);
+    origin.y = clamp_axis(origin.y, static_cast<float>(world_size.y), view_cells.y, pixels_per_cell);
+}
@@ -0,0 +1,101 @@
+﻿#pragma once
+
+#include <SFML/Graphics/Rect.hpp>
+
+#include <SFML/System/Vector2.hpp>
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Maps between view positions and world cells                                       
+// Zoomed in the world is drawn with a whole number of pixels per cell, zoomed out past one 
+// pixel per cell every pixel shows a block of 2^level x 2^level cells, see LodPyramid. The 
+// view always lands on a pixel boundary, so cells stay sharp at every zoom and position    
+//////////////////////////////////////////////////////////////////////////////////////////////
+class Camera {
+public:
+	//////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Creates a camera showing the top left corner of the world at the default zoom 
+	// \param world_size The size of the world in cells {width, height}                     
+	//////////////////////////////////////////////////////////////////////////////////////////
+	Camera(sf::Vector2i world_size);
+
+	///////////////////////////////////////////////////////////////////////////////////
+	// \brief Sets the size of the area the world is drawn into, in view coordinates 
+	// \param size The size of the area {width, height}                              
+	///////////////////////////////////////////////////////////////////////////////////
+	void set_view_size(sf::Vector2f size);
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Moves the camera, half the view stays over the world or all of a smaller world stays in view 
+	// \param offset How far to move in view coordinates                                                   
+	/////////////////////////////////////////////////////////////////////////////////////////////////////////
+	void pan(sf::Vector2f offset);
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Zooms in or out while keeping the cell under anchor in place                                   
+	// Below one pixel per cell every step halves or doubles the cells per pixel, until the whole world fits 
+	// \param steps Positive zooms in, negative zooms out, one step is roughly 25%                           
+	// \param anchor The position in view coordinates that should not move                                   
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////
+	void zoom(int steps, sf::Vector2f anchor);
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Moves the camera part of the way towards centering a target                              
+	// Targets in the middle half of the view are left alone, so the camera only drifts near the edges 
+	// \param target The position in view coordinates to follow                                        
+	// \param rate The part of the remaining distance covered by one call, between 0 and 1             
+	/////////////////////////////////////////////////////////////////////////////////////////////////////
+	void follow(sf::Vector2f target, float rate);
+
+	///////////////////////////////////////////////////////////////////////
+	// \brief Returns the world position under a view position, in cells 
+	// \param position The position in view coordinates                  
+	///////////////////////////////////////////////////////////////////////
+	sf::Vector2f view_to_world(sf::Vector2f position) const;
+
+	/////////////////////////////////////////////////////////////////////////
+	// \brief Returns the view position of a world position given in cells 
+	// \param position The position in cells                               
+	/////////////////////////////////////////////////////////////////////////
+	sf::Vector2f world_to_view(sf::Vector2f position) const;
+
+	////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the cells at least partly inside the view, clipped to the world 
+	// Its size is zero when no part of the world is visible                          
+	////////////////////////////////////////////////////////////////////////////////////
+	sf::IntRect get_visible_cells() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the size of one cell plus its gap in pixels, 1 when zoomed out past that 
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	int get_cell_stride() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the space between two cells in pixels, zoomed out far enough it is 0 
+	/////////////////////////////////////////////////////////////////////////////////////////
+	int get_gap() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns log2 of the cells per pixel along each axis, 0 unless zoomed out past one pixel per cell 
+	/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int get_level() const;
+
+	static constexpr int min_cell_stride = 1;
+	static constexpr int max_cell_stride = 64;
+
+private:
+	float get_pixels_per_cell() const;
+
+	int get_max_level() const;
+
+	void clamp_origin();
+
+	sf::Vector2i world_size;
+	sf::Vector2f view_size = { 640.f, 360.f };
+
+	// The world position at the top left corner of the view, in cells
+	sf::Vector2f origin = { 0.f, 0.f };
+
+	int cell_stride = 9;
+	int level = 0;
+};
@@ -0,0 +1,37 @@
+﻿#include "chunk_table.hpp"
+
+
+//////////////////////////////
+// Functions for ChunkTable //
+//////////////////////////////
+
+void ChunkTable::reset(sf::Vector2i chunk_count) {
+    this->chunk_count = chunk_count;
+    page_columns = (chunk_count.x + page_mask) >> page_shift;
+
+    const int page_rows = (chunk_count.y + page_mask) >> page_shift;
+
+    page_starts.assign(static_cast<std::size_t>(page_columns) * page_rows, -1);
+    slots.clear();
+}
+
+
+void ChunkTable::set_slot(sf::Vector2i chunk, std::int32_t slot) {
+    std::int32_t& page = page_starts[(chunk.y >> page_shift) * page_columns + (chunk.x >> page_shift)];
+
+    if (page < 0) {
+        if (slot == 0) {
+            return;
+        }
+
+        page = static_cast<std::int32_t>(slots.size());
+        slots.resize(slots.size() + (1 << (2 * page_shift)), 0);
+    }
+
+    slots[page + (((chunk.y & page_mask) << page_shift) | (chunk.x & page_mask))] = slot;
+}
+
+
+sf::Vector2i ChunkTable::get_chunk_count() const {
+    return chunk_count;
+}
@@ -0,0 +1,53 @@
+﻿#pragma once
+
+#include <SFML/System/Vector2.hpp>
+
+#include <vector>
+#include <cstdint>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Maps chunk coordinates to the slot their cells are stored in                           
+// Cell planes hold one block of cells per slot. Slot 0 is a chunk of air at ambient temperature 
+// that is never written, every chunk without cells of its own reads from it. The table is split 
+// into pages that are only allocated once one of their chunks gets a slot, so a huge world that 
+// is mostly empty costs next to nothing                                                         
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class ChunkTable {
+public:
+	///////////////////////////////////////////////////////////////
+	// \brief Resizes the table, every chunk goes back to slot 0 
+	// \param chunk_count The number of chunks {columns, rows}   
+	///////////////////////////////////////////////////////////////
+	void reset(sf::Vector2i chunk_count);
+
+	///////////////////////////////////////////////////////////////////////////
+	// \brief Returns the slot of a chunk, 0 when it has no cells of its own 
+	// \param chunk The chunk {column, row}, it must be inside the table     
+	///////////////////////////////////////////////////////////////////////////
+	std::int32_t get_slot(sf::Vector2i chunk) const {
+		const std::int32_t page = page_starts[(chunk.y >> page_shift) * page_columns + (chunk.x >> page_shift)];
+
+		if (page < 0) {
+			return 0;
+		}
+
+		return slots[page + (((chunk.y & page_mask) << page_shift) | (chunk.x & page_mask))];
+	}
+
+	void set_slot(sf::Vector2i chunk, std::int32_t slot);
+
+	sf::Vector2i get_chunk_count() const;
+
+private:
+	// A page covers 64x64 chunks
+	static constexpr int page_shift = 6;
+	static constexpr int page_mask = (1 << page_shift) - 1;
+
+	sf::Vector2i chunk_count;
+	int page_columns = 0;
+
+	// Where each page starts in slots, -1 until one of its chunks gets a slot
+	std::vector<std::int32_t> page_starts;
+	std::vector<std::int32_t> slots;
+};
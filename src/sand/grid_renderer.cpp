@@ -0,0 +1,119 @@
+﻿#include <SFML/Graphics/Sprite.hpp>
+#include <SFML/Graphics/Image.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "grid_renderer.hpp"
+#include "src/profiler/profiler.hpp"
+
+
+void GridRenderer::resize(sf::Vector2u size) {
+    if (size == this->size) {
+        return;
+    }
+
+    this->size = size;
+
+    pixels.assign(static_cast<std::size_t>(size.x) * size.y, sf::Color::Black);
+    changed_rows.assign(size.y, 1);
+
+    if (not grid_texture.resize(size)) {
+        this->size = { 0, 0 };
+    }
+}
+
+
+void GridRenderer::write(sf::Vector2i position, const sf::Color* colors, int count) {
+    sf::Color* destination = &pixels[static_cast<std::size_t>(position.y) * size.x + position.x];
+
+    if (std::memcmp(destination, colors, count * sizeof(sf::Color)) == 0) {
+        return;
+    }
+
+    std::memcpy(destination, colors, count * sizeof(sf::Color));
+    changed_rows[position.y] = 1;
+}
+
+
+void GridRenderer::draw(sf::RenderTarget& target, sf::Vector2f position, int cell_px, int gap) {
+    PROFILE_SCOPE("grid_draw");
+
+    if (size.x == 0 or size.y == 0) {
+        return;
+    }
+
+    upload_changed_rows();
+
+    const float cell_stride = static_cast<float>(cell_px + gap);
+
+    sf::Sprite grid(grid_texture);
+    grid.setScale({ cell_stride, cell_stride });
+    grid.setPosition(position);
+    target.draw(grid);
+
+    if (gap <= 0) {
+        return;
+    }
+
+    if (cell_px != gap_texture_cell_px or gap != gap_texture_gap) {
+        rebuild_gap_texture(cell_px, gap);
+    }
+
+    const sf::Vector2i grid_px = {
+        static_cast<int>(size.x) * (cell_px + gap),
+        static_cast<int>(size.y) * (cell_px + gap)
+    };
+
+    sf::Sprite gaps(gap_texture, sf::IntRect({ 0, 0 }, grid_px));
+    gaps.setPosition(position);
+    target.draw(gaps);
+}
+
+
+void GridRenderer::upload_changed_rows() {
+    // Consecutive changed rows are sent to the gpu as one block
+    unsigned int y = 0;
+
+    while (y < size.y) {
+        if (not changed_rows[y]) {
+            y++;
+            continue;
+        }
+
+        const unsigned int first = y;
+        while (y < size.y and changed_rows[y]) {
+            changed_rows[y] = 0;
+            y++;
+        }
+
+        grid_texture.update(
+            reinterpret_cast<const std::uint8_t*>(&pixels[static_cast<std::size_t>(first) * size.x]),
+            { size.x, y - first },
+            { 0, first }
+        );
+    }
+}
+
+
+void GridRenderer::rebuild_gap_texture(int cell_px, int gap) {
+    const unsigned int stride = static_cast<unsigned int>(cell_px + gap);
+
+    sf::Image image({ stride, stride }, sf::Color::Transparent);
+
+    for (unsigned int y = 0; y < stride; y++) {
+        for (unsigned int x = 0; x < stride; x++) {
+            if (x >= static_cast<unsigned int>(cell_px) or y >= static_cast<unsigned int>(cell_px)) {
+                image.setPixel({ x, y }, sf::Color::Black);
+            }
+        }
+    }
+
+    if (not gap_texture.loadFromImage(image)) {
+        return;
+    }
+
+    gap_texture.setRepeated(true);
+    gap_texture_cell_px = cell_px;
+    gap_texture_gap = gap;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <SFML/Graphics/RenderTarget.hpp>
+#include <SFML/Graphics/Texture.hpp>
+#include <SFML/Graphics/Color.hpp>
+
+#include <SFML/System/Vector2.hpp>
+
+#include <vector>
+#include <cstdint>
+
+
+static_assert(sizeof(sf::Color) == 4, "GridRenderer uploads sf::Color rows as RGBA8 pixels");
+
+
+class GridRenderer {
+public:
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Resizes the pixel buffer to one pixel per cell, everything is uploaded on the next draw 
+	// \param size The size of the drawn part of the grid {width, height}                             
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void resize(sf::Vector2u size);
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Copies a run of cell colors into the pixel buffer, remembering the row if it changed 
+	// Different rows may be written from different threads at the same time                       
+	// \param position The first cell of the run, relative to the drawn part of the grid           
+	// \param colors The colors of the run                                                         
+	// \param count The number of cells in the run                                                 
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	void write(sf::Vector2i position, const sf::Color* colors, int count);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// \brief Uploads the changed rows and draws the grid as one scaled sprite  
+	// \param target The sfml target to draw the image to                       
+	// \param position Where the top left cell of the buffer goes on the target 
+	// \param cell_px The size of one cell in pixels                            
+	// \param gap The space between two cells in pixels                         
+	//////////////////////////////////////////////////////////////////////////////
+	void draw(sf::RenderTarget& target, sf::Vector2f position, int cell_px, int gap);
+
+private:
+	void upload_changed_rows();
+
+	void rebuild_gap_texture(int cell_px, int gap);
+
+	sf::Vector2u size;
+
+	std::vector<sf::Color> pixels;
+	std::vector<std::uint8_t> changed_rows;
+
+	sf::Texture grid_texture;
+
+	// One cell plus its gap, with the gap painted over the grid by repeating it
+	sf::Texture gap_texture;
+	int gap_texture_cell_px = -1;
+	int gap_texture_gap = -1;
+};
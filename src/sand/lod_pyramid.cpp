@@ -0,0 +1,284 @@
+﻿#include <algorithm>
+#include <climits>
+
+#include "lod_pyramid.hpp"
+
+
+// Up to four cells or texels being averaged into one texel
+struct TexelSum {
+    int r = 0;
+    int g = 0;
+    int b = 0;
+    int a = 0;
+    float temp = 0.f;
+    float matter = 0.f;
+    int count = 0;
+
+    void add(sf::Color color, float texel_temp, float texel_matter) {
+        r += color.r;
+        g += color.g;
+        b += color.b;
+        a += color.a;
+
+        // Air carries no temperature worth showing, so only matter is weighed in
+        temp += texel_temp * texel_matter;
+        matter += texel_matter;
+        count++;
+    }
+
+    void write(sf::Color& color, float& texel_temp, float& texel_matter) const {
+        color = sf::Color(
+            static_cast<std::uint8_t>(r / count),
+            static_cast<std::uint8_t>(g / count),
+            static_cast<std::uint8_t>(b / count),
+            static_cast<std::uint8_t>(a / count)
+        );
+        texel_temp = matter > 0.f ? temp / matter : ambient_temp;
+        texel_matter = matter / count;
+    }
+};
+
+
+void LodPyramid::update(const CellPlanes& cells, int max_level, ThreadPool* pool) {
+    if (cells.size != size or cells.chunk_shift != chunk_shift) {
+        reset(cells);
+    }
+
+    chunk_table = cells.chunk_table;
+
+    const std::size_t slot_count = static_cast<std::size_t>(cells.slot_count);
+
+    if (built_stamps.size() < slot_count) {
+        // No change version is UINT64_MAX, so new slots are always downsampled
+        built_stamps.resize(slot_count, { { -1, -1 }, UINT64_MAX });
+
+        for (int level = 1; level <= chunk_shift; level++) {
+            const std::size_t side = std::size_t(1) << (chunk_shift - level);
+            Level& slot_level = slot_levels[level - 1];
+
+            slot_level.colors.resize(slot_count * side * side);
+            slot_level.temps.resize(slot_count * side * side);
+            slot_level.matter.resize(slot_count * side * side);
+        }
+    }
+
+    bool empty_chunk_changed = false;
+    changed_slots.clear();
+
+    for (std::size_t slot = 0; slot < slot_count; slot++) {
+        const ChunkStamp& stamp = cells.chunk_stamps[slot];
+        ChunkStamp& built = built_stamps[slot];
+
+        if (stamp.tile == built.tile and stamp.version == built.version) {
+            continue;
+        }
+
+        // A chunk that lost this slot reads slot 0 from now on
+        if (built.tile.x >= 0 and built.tile != stamp.tile) {
+            dirty_tiles.push_back(built.tile);
+        }
+
+        if (slot == 0 or stamp.tile.x >= 0) {
+            changed_slots.push_back(static_cast<int>(slot));
+        }
+
+        if (slot == 0) {
+            empty_chunk_changed = true;
+        }
+        else if (stamp.tile.x >= 0) {
+            dirty_tiles.push_back(stamp.tile);
+        }
+
+        built = stamp;
+    }
+
+    // Every slot has texels of its own, so slots can be downsampled side by side
+    auto downsample = [this, &cells](std::size_t i) {
+        downsample_chunk(cells, changed_slots[i]);
+    };
+
+    if (pool) {
+        pool->parallel_for(0, changed_slots.size(), 16, downsample);
+    }
+    else {
+        for (std::size_t i = 0; i < changed_slots.size(); i++) {
+            downsample(i);
+        }
+    }
+
+    // Every chunk without a slot of its own reads slot 0, so the grids start over
+    if (empty_chunk_changed) {
+        grid_levels.clear();
+    }
+
+    update_grid_levels(std::max(0, max_level - chunk_shift));
+}
+
+
+TexelRun LodPyramid::get_run(int level, sf::Vector2i texel, int& count) const {
+    if (level <= chunk_shift) {
+        const int side_shift = chunk_shift - level;
+        const int side = 1 << side_shift;
+
+        const std::size_t slot = static_cast<std::size_t>(chunk_table->get_slot({ texel.x >> side_shift, texel.y >> side_shift }));
+        const sf::Vector2i local = { texel.x & (side - 1), texel.y & (side - 1) };
+        const std::size_t index = (slot << (2 * side_shift)) + (local.y << side_shift) + local.x;
+
+        const Level& source = slot_levels[level - 1];
+        count = side - local.x;
+
+        return { &source.colors[index], &source.temps[index], &source.matter[index] };
+    }
+
+    const Level& source = grid_levels[level - chunk_shift - 1];
+    const std::size_t index = static_cast<std::size_t>(texel.y) * source.size.x + texel.x;
+    count = source.size.x - texel.x;
+
+    return { &source.colors[index], &source.temps[index], &source.matter[index] };
+}
+
+
+void LodPyramid::reset(const CellPlanes& cells) {
+    size = cells.size;
+    chunk_count = cells.chunk_count;
+    chunk_shift = cells.chunk_shift;
+
+    slot_levels.assign(chunk_shift, Level());
+    grid_levels.clear();
+    built_stamps.clear();
+    dirty_tiles.clear();
+}
+
+
+void LodPyramid::downsample_chunk(const CellPlanes& cells, int slot) {
+    const std::size_t first_cell = static_cast<std::size_t>(slot) << (2 * chunk_shift);
+
+    // Level 1 is averaged from the cells
+    {
+        const int side_shift = chunk_shift - 1;
+        const int side = 1 << side_shift;
+        const std::size_t first = static_cast<std::size_t>(slot) << (2 * side_shift);
+
+        Level& target = slot_levels[0];
+
+        for (int y = 0; y < side; y++) {
+            const std::size_t top = first_cell + (static_cast<std::size_t>(2 * y) << chunk_shift);
+            const std::size_t bottom = top + (std::size_t(1) << chunk_shift);
+
+            for (int x = 0; x < side; x++) {
+                TexelSum sum;
+
+                for (const std::size_t i : { top + 2 * x, top + 2 * x + 1, bottom + 2 * x, bottom + 2 * x + 1 }) {
+                    sum.add(get_cell_color(cells.materials[i], cells.shades[i]), cells.temps[i], cells.materials[i] == MaterialID::Air ? 0.f : 1.f);
+                }
+
+                const std::size_t index = first + (y << side_shift) + x;
+                sum.write(target.colors[index], target.temps[index], target.matter[index]);
+            }
+        }
+    }
+
+    // Every further level up to the chunk size from the one below
+    for (int level = 2; level <= chunk_shift; level++) {
+        const int side_shift = chunk_shift - level;
+        const int side = 1 << side_shift;
+        const std::size_t first = static_cast<std::size_t>(slot) << (2 * side_shift);
+        const std::size_t source_first = static_cast<std::size_t>(slot) << (2 * (side_shift + 1));
+
+        const Level& source = slot_levels[level - 2];
+        Level& target = slot_levels[level - 1];
+
+        for (int y = 0; y < side; y++) {
+            const std::size_t top = source_first + (static_cast<std::size_t>(2 * y) << (side_shift + 1));
+            const std::size_t bottom = top + (std::size_t(2) << side_shift);
+
+            for (int x = 0; x < side; x++) {
+                TexelSum sum;
+
+                for (const std::size_t i : { top + 2 * x, top + 2 * x + 1, bottom + 2 * x, bottom + 2 * x + 1 }) {
+                    sum.add(source.colors[i], source.temps[i], source.matter[i]);
+                }
+
+                const std::size_t index = first + (y << side_shift) + x;
+                sum.write(target.colors[index], target.temps[index], target.matter[index]);
+            }
+        }
+    }
+}
+
+
+void LodPyramid::update_grid_levels(int grid_level_count) {
+    // Levels that already exist only build the texels above changed chunks
+    for (std::size_t grid_level = 0; grid_level < grid_levels.size(); grid_level++) {
+        Level& level = grid_levels[grid_level];
+
+        dirty_texels.clear();
+
+        for (sf::Vector2i tile : dirty_tiles) {
+            const sf::Vector2i texel = { tile.x >> 1, tile.y >> 1 };
+            std::uint8_t& queued = level.queued[static_cast<std::size_t>(texel.y) * level.size.x + texel.x];
+
+            if (not queued) {
+                queued = 1;
+                dirty_texels.push_back(texel);
+            }
+        }
+
+        for (sf::Vector2i texel : dirty_texels) {
+            build_grid_texel(grid_level, texel);
+            level.queued[static_cast<std::size_t>(texel.y) * level.size.x + texel.x] = 0;
+        }
+
+        dirty_tiles.swap(dirty_texels);
+    }
+
+    dirty_tiles.clear();
+
+    // New levels are built whole, once
+    while (grid_levels.size() < static_cast<std::size_t>(grid_level_count)) {
+        const sf::Vector2i below = grid_levels.empty() ? chunk_count : grid_levels.back().size;
+        const std::size_t grid_level = grid_levels.size();
+
+        Level& level = grid_levels.emplace_back();
+        level.size = { (below.x + 1) / 2, (below.y + 1) / 2 };
+
+        const std::size_t texel_count = static_cast<std::size_t>(level.size.x) * level.size.y;
+        level.colors.resize(texel_count);
+        level.temps.resize(texel_count);
+        level.matter.resize(texel_count);
+        level.queued.assign(texel_count, 0);
+
+        for (int y = 0; y < level.size.y; y++) {
+            for (int x = 0; x < level.size.x; x++) {
+                build_grid_texel(grid_level, { x, y });
+            }
+        }
+    }
+}
+
+
+void LodPyramid::build_grid_texel(std::size_t grid_level, sf::Vector2i texel) {
+    // The first grid level reads one texel per chunk from the last slot level
+    const Level& source = grid_level == 0 ? slot_levels.back() : grid_levels[grid_level - 1];
+    const sf::Vector2i source_size = grid_level == 0 ? chunk_count : source.size;
+
+    Level& target = grid_levels[grid_level];
+    TexelSum sum;
+
+    for (int offset = 0; offset < 4; offset++) {
+        const sf::Vector2i child = { 2 * texel.x + offset % 2, 2 * texel.y + offset / 2 };
+
+        if (child.x >= source_size.x or child.y >= source_size.y) {
+            continue;
+        }
+
+        const std::size_t i = grid_level == 0
+            ? static_cast<std::size_t>(chunk_table->get_slot(child))
+            : static_cast<std::size_t>(child.y) * source_size.x + child.x;
+
+        sum.add(source.colors[i], source.temps[i], source.matter[i]);
+    }
+
+    const std::size_t index = static_cast<std::size_t>(texel.y) * target.size.x + texel.x;
+    sum.write(target.colors[index], target.temps[index], target.matter[index]);
+}
@@ -0,0 +1,83 @@
+﻿#pragma once
+
+#include <SFML/Graphics/Color.hpp>
+
+#include <SFML/System/Vector2.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "world_snapshot.hpp"
+#include "visualization.hpp"
+#include "src/multi-threading/thread_pool.hpp"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Downsampled copies of the cell colors and temperatures for drawing zoomed out          
+// A texel of level l stands for a block of 2^l x 2^l cells. Up to the chunk size the texels of  
+// a chunk are stored per slot like its cells, so empty chunks share the texels of slot 0. Above 
+// the chunk size every level is one grid over the whole world, built from the level below.      
+// update only downsamples the chunks whose stamp changed and the grid texels above them         
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class LodPyramid {
+public:
+	////////////////////////////////////////////////////////////////////////////////
+	// \brief Brings every level up to max_level up to date with the cells        
+	// \param cells The cells to downsample, its chunk stamps must be set         
+	// \param max_level The highest level that will be read until the next update 
+	// \param pool Downsamples the changed chunks in parallel when given          
+	////////////////////////////////////////////////////////////////////////////////
+	void update(const CellPlanes& cells, int max_level, ThreadPool* pool = nullptr);
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the texels from one texel to the end of its row in the block it is stored in 
+	// \param level The level to read, from 1 up to the max_level given to update                  
+	// \param texel The first texel {x, y} of the run                                              
+	// \param count Receives the number of texels in the run                                       
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	TexelRun get_run(int level, sf::Vector2i texel, int& count) const;
+
+private:
+	struct Level {
+		std::vector<sf::Color> colors;
+
+		// The average temperature of the cells that are not air
+		std::vector<float> temps;
+
+		// The part of the cells that are not air, between 0 and 1
+		std::vector<float> matter;
+
+		// Grid levels only, slot levels hold one block of texels per slot
+		sf::Vector2i size;
+		std::vector<std::uint8_t> queued;
+	};
+
+	void reset(const CellPlanes& cells);
+
+	void downsample_chunk(const CellPlanes& cells, int slot);
+
+	void update_grid_levels(int grid_level_count);
+
+	void build_grid_texel(std::size_t grid_level, sf::Vector2i texel);
+
+	sf::Vector2i size;
+	sf::Vector2i chunk_count;
+	int chunk_shift = -1;
+
+	// The table of the cells given to the last update
+	const ChunkTable* chunk_table = nullptr;
+
+	// Levels 1 to chunk_shift, then chunk_shift + 1 and up
+	std::vector<Level> slot_levels;
+	std::vector<Level> grid_levels;
+
+	// The stamp of every slot when it was last downsampled
+	std::vector<ChunkStamp> built_stamps;
+
+	// Slots to downsample in this update
+	std::vector<int> changed_slots;
+
+	// Chunks whose grid texels have to be built again
+	std::vector<sf::Vector2i> dirty_tiles;
+	std::vector<sf::Vector2i> dirty_texels;
+};
@@ -6,396 +6,1959 @@
 #include <format>
 #include <thread>
 #include <iostream>
+#include <bit>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <utility>
 
 #include "particle_simulation.hpp"
 #include "particles.hpp"
+#include "thermal.hpp"
+#include "src/profiler/profiler.hpp"
 
 
-sf::Font arial("fonts/Arial.ttf");
+/////////////////////////////////////////////
+// Public functions for ParticleSimulation //
+/////////////////////////////////////////////
+
+ParticleSimulation::ParticleSimulation(sf::Vector2i size, std::uint64_t seed) : size(size), seed(seed), camera(size) {
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    multithreading_core_count = thread_count ? thread_count : 4;
+
+    // A particle reaches at most half a tile past its own cell, so same-phase
+    // tiles, a whole tile apart, never touch the same cell. Tiles are at least
+    // two cells wide so particles can always move one cell, and are rounded to a
+    // power of two so cell lookups are shifts and masks
+    multithreading_kernel_size = std::bit_ceil(std::max(2u, multithreading_kernel_size));
+    chunk_shift = std::countr_zero(multithreading_kernel_size);
+    max_speed = static_cast<std::uint8_t>(std::min(multithreading_kernel_size / 2, 255u));
+
+    create_thread_pool();
+
+    const int chunk_size = static_cast<int>(multithreading_kernel_size);
+    chunk_count = { (size.x + chunk_size - 1) / chunk_size, (size.y + chunk_size - 1) / chunk_size };
+    chunk_table.reset(chunk_count);
+
+    // Cells are stored chunk by chunk, edge chunks are padded with air. Only
+    // slot 0, the empty chunk every other chunk starts out as, exists so far
+    const std::size_t len = std::size_t(1) << (2 * chunk_shift);
+
+    chunks.emplace_back();
+
+    cell_materials.assign(len, MaterialID::Air);
+    cell_temps.assign(len, ambient_temp);
+    cell_temps_next.assign(len, ambient_temp);
+    cell_shades.assign(len, 0);
+    cell_motions.assign(len, Motion());
+    cell_moved_tick.assign(len, 0);
+
+    // The padding of edge chunks is not part of the world, so it is not counted
+    material_counts[(size_t)MaterialID::Air] = static_cast<std::int64_t>(size.x) * size.y;
+}
+
+
+ParticleSimulation::ParticleSimulation(const WorldSnapshot& snapshot) : ParticleSimulation(snapshot.size, snapshot.seed) {
+    const CellPlanes source = snapshot.get_cell_planes();
+    const int source_chunk_size = 1 << source.chunk_shift;
+
+    // The snapshot may be chunked differently, so cells are copied in row runs
+    // that never cross a chunk border in either layout
+    const int run_size = std::min(static_cast<int>(multithreading_kernel_size), source_chunk_size);
+
+    // Chunks the snapshot has no cells for are empty and stay that way here
+    for (int source_y = 0; source_y < source.chunk_count.y; source_y++) {
+        for (int source_x = 0; source_x < source.chunk_count.x; source_x++) {
+            if (source.chunk_table->get_slot({ source_x, source_y }) == 0) {
+                continue;
+            }
+
+            const sf::Vector2i min = { source_x * source_chunk_size, source_y * source_chunk_size };
+            const sf::Vector2i max = { std::min(size.x, min.x + source_chunk_size), std::min(size.y, min.y + source_chunk_size) };
+
+            allocate_chunks(min, max - sf::Vector2i(1, 1));
+
+            for (int y = min.y; y < max.y; y++) {
+                for (int x = min.x; x < max.x; x += run_size) {
+                    const int width = std::min(run_size, max.x - x);
+                    const int from = source.get_index({ x, y });
+                    const int to = get_index({ x, y });
+
+                    for (int i = 0; i < width; i++) {
+                        set_material(to + i, source.materials[from + i]);
+                    }
+
+                    std::copy_n(&source.temps[from], width, &cell_temps[to]);
+                    std::copy_n(&source.temps[from], width, &cell_temps_next[to]);
+                    std::copy_n(&source.shades[from], width, &cell_shades[to]);
+                }
+            }
+        }
+    }
+
+    tick = snapshot.tick;
+
+    change_version++;
+
+    for (std::size_t slot = 1; slot < chunks.size(); slot++) {
+        const sf::Vector2i min = chunks[slot].tile * static_cast<int>(multithreading_kernel_size);
+        mark_dirty(min, min + sf::Vector2i(multithreading_kernel_size - 1, multithreading_kernel_size - 1));
+    }
+}
+
+
+void ParticleSimulation::update() {
+    PROFILE_SCOPE("update");
+
+    tick++;
+    change_version++;
+
+    advance_chunks();
+
+    present_materials = 0;
+    for (size_t i = 0; i < material_counts.size(); i++) {
+        if (material_counts[i].load(std::memory_order_relaxed) > 0) {
+            present_materials |= 1u << i;
+        }
+    }
+
+    update_thermal();
+
+    // The tiled path is used even on a single core so that a world evolves the
+    // same way no matter how many cores the machine replaying it has
+    if (multithreading_enabled) {
+        update_parallel();
+    }
+    else {
+        update_serial();
+    }
+}
+
+
+void ParticleSimulation::set_multithreading(bool enabled, std::size_t core_count) {
+    multithreading_enabled = enabled;
+
+    if (core_count != 0 and core_count != multithreading_core_count) {
+        multithreading_core_count = core_count;
+        create_thread_pool();
+    }
+}
+
+
+void ParticleSimulation::set_thread_pinning(bool enabled) {
+    if (enabled != multithreading_pin_threads) {
+        multithreading_pin_threads = enabled;
+        create_thread_pool();
+    }
+}
+
+
+void ParticleSimulation::set_thermal_coarse_interval(unsigned int interval) {
+    thermal_coarse_interval = interval;
+}
+
+
+void ParticleSimulation::brush(int brush_size, sf::Vector2i position, MaterialID material) {
+    if (const std::optional<sf::Vector2i> cell = get_cell_at(position)) {
+        paint(brush_size, *cell, material);
+    }
+}
+
+
+void ParticleSimulation::paint(int brush_size, sf::Vector2i cell, MaterialID material) {
+    const int half = brush_size / 2;
+
+    fill_rect(cell - sf::Vector2i(half, half), cell + sf::Vector2i(half, half), material);
+}
+
+
+void ParticleSimulation::fill_rect(sf::Vector2i min, sf::Vector2i max, MaterialID material) {
+    change_version++;
+
+    min = { std::max(0, min.x), std::max(0, min.y) };
+    max = { std::min(size.x - 1, max.x), std::min(size.y - 1, max.y) };
+
+    for (int y = min.y; y <= max.y; y++) {
+        fill_span(y, min.x, max.x, material, false);
+    }
+}
+
+
+void ParticleSimulation::fill_circle(sf::Vector2i center, int radius, MaterialID material) {
+    change_version++;
+
+    // Squared in 64 bits, the edit API takes any radius and int would overflow past 46340
+    const std::int64_t radius_squared = static_cast<std::int64_t>(radius) * radius;
+
+    const int min_y = static_cast<int>(std::max<std::int64_t>(0, static_cast<std::int64_t>(center.y) - radius));
+    const int max_y = static_cast<int>(std::min<std::int64_t>(size.y - 1, static_cast<std::int64_t>(center.y) + radius));
+
+    for (int y = min_y; y <= max_y; y++) {
+        const std::int64_t dy = static_cast<std::int64_t>(y) - center.y;
+        const std::int64_t half_width = static_cast<std::int64_t>(std::sqrt(static_cast<double>(radius_squared - dy * dy)));
+
+        const int min_x = static_cast<int>(std::max<std::int64_t>(0, center.x - half_width));
+        const int max_x = static_cast<int>(std::min<std::int64_t>(size.x - 1, center.x + half_width));
+
+        if (min_x <= max_x) {
+            fill_span(y, min_x, max_x, material, false);
+        }
+    }
+}
+
+
+void ParticleSimulation::fill_line(sf::Vector2i from, sf::Vector2i to, int brush_size, MaterialID material) {
+    // Keeps cells whose center lies exactly on the edge of the brush out of it
+    static const float edge_tolerance = 1e-4f;
+
+    change_version++;
+
+    // The brush covers the cells whose centers are within reach of its own, which
+    // reaches half a cell further than its outermost cells
+    const int half = brush_size / 2;
+    const float reach = half + 0.5f - edge_tolerance;
+    const sf::Vector2f delta(to - from);
+
+    const int min_y = std::max(0, std::min(from.y, to.y) - half);
+    const int max_y = std::min(size.y - 1, std::max(from.y, to.y) + half);
+
+    for (int y = min_y; y <= max_y; y++) {
+        // The stretch of the line, as a fraction of it, where the brush covers this row.
+        // The brush covers one unbroken run of every row, between its x at both ends
+        float start = 0.f;
+        float end = 1.f;
+
+        if (delta.y != 0.f) {
+            start = (y - reach - from.y) / delta.y;
+            end = (y + reach - from.y) / delta.y;
+
+            if (start > end) {
+                std::swap(start, end);
+            }
+
+            start = std::max(start, 0.f);
+            end = std::min(end, 1.f);
+
+            if (start > end) {
+                continue;
+            }
+        }
+
+        const float start_x = from.x + delta.x * start;
+        const float end_x = from.x + delta.x * end;
+
+        const int min_x = std::max(0, static_cast<int>(std::ceil(std::min(start_x, end_x) - reach)));
+        const int max_x = std::min(size.x - 1, static_cast<int>(std::floor(std::max(start_x, end_x) + reach)));
+
+        if (min_x <= max_x) {
+            fill_span(y, min_x, max_x, material, false);
+        }
+    }
+}
+
+
+std::size_t ParticleSimulation::flood_fill(sf::Vector2i cell, MaterialID material, std::size_t max_cells) {
+    const int start = get_index(cell);
+
+    if (start == -1 or cell_materials[start] == material) {
+        return 0;
+    }
+
+    change_version++;
+
+    const MaterialID target = cell_materials[start];
+
+    auto is_target = [&](sf::Vector2i position) {
+        const int index = get_index(position);
+        return index != -1 and cell_materials[index] == target;
+    };
+
+    // Scanline fill: every seed grows into the whole run of its row, then the rows
+    // above and below get one seed per run of the target material next to it
+    std::vector<sf::Vector2i> seeds = { cell };
+    std::size_t filled = 0;
+
+    while (not seeds.empty() and filled < max_cells) {
+        const sf::Vector2i seed = seeds.back();
+        seeds.pop_back();
+
+        if (not is_target(seed)) {
+            continue;
+        }
+
+        int min_x = seed.x;
+        int max_x = seed.x;
+
+        while (is_target({ min_x - 1, seed.y })) {
+            min_x--;
+        }
+        while (is_target({ max_x + 1, seed.y })) {
+            max_x++;
+        }
+
+        max_x = static_cast<int>(std::min<std::int64_t>(max_x, min_x + static_cast<std::int64_t>(max_cells - filled) - 1));
+
+        fill_span(seed.y, min_x, max_x, material, true);
+        filled += max_x - min_x + 1;
+
+        for (int y : { seed.y - 1, seed.y + 1 }) {
+            bool in_run = false;
+
+            for (int x = min_x; x <= max_x; x++) {
+                const bool target_cell = is_target({ x, y });
+
+                if (target_cell and not in_run) {
+                    seeds.push_back({ x, y });
+                }
+                in_run = target_cell;
+            }
+        }
+    }
+
+    return filled;
+}
+
+
+void ParticleSimulation::copy_stamp(sf::Vector2i min, sf::Vector2i max, CellStamp& stamp) const {
+    min = { std::max(0, min.x), std::max(0, min.y) };
+    max = { std::min(size.x - 1, max.x), std::min(size.y - 1, max.y) };
+
+    stamp.size = { std::max(0, max.x - min.x + 1), std::max(0, max.y - min.y + 1) };
+
+    const std::size_t len = static_cast<std::size_t>(stamp.size.x) * stamp.size.y;
+    stamp.materials.resize(len);
+    stamp.temps.resize(len);
+    stamp.shades.resize(len);
+
+    const int chunk_mask = (1 << chunk_shift) - 1;
+
+    for (int y = min.y; y <= max.y; y++) {
+        std::size_t target = static_cast<std::size_t>(y - min.y) * stamp.size.x;
+
+        // The cells of a row are contiguous up to the end of their chunk
+        for (int x = min.x; x <= max.x; ) {
+            const int run = std::min(max.x, x | chunk_mask) - x + 1;
+            const int index = get_index({ x, y });
+
+            std::copy_n(&cell_materials[index], run, &stamp.materials[target]);
+            std::copy_n(&cell_temps[index], run, &stamp.temps[target]);
+            std::copy_n(&cell_shades[index], run, &stamp.shades[target]);
+
+            target += run;
+            x += run;
+        }
+    }
+}
+
+
+void ParticleSimulation::paste_stamp(const CellStamp& stamp, sf::Vector2i position, bool skip_air) {
+    change_version++;
+
+    const int min_x = std::max(0, position.x);
+    const int max_x = std::min(size.x - 1, position.x + stamp.size.x - 1);
+    const int min_y = std::max(0, position.y);
+    const int max_y = std::min(size.y - 1, position.y + stamp.size.y - 1);
+
+    if (min_x > max_x) {
+        return;
+    }
+
+    const int chunk_mask = (1 << chunk_shift) - 1;
+
+    for (int y = min_y; y <= max_y; y++) {
+        const std::size_t row = static_cast<std::size_t>(y - position.y) * stamp.size.x;
+
+        // Like in fill_span the counts change once per row instead of once per cell
+        std::array<std::int64_t, (size_t)MaterialID::COUNT> count_changes = {};
+
+        for (int x = min_x; x <= max_x; ) {
+            const int run = std::min(max_x, x | chunk_mask) - x + 1;
+            const std::size_t source = row + (x - position.x);
+
+            // Air needs no cells of its own, anything else gets its chunk first
+            const bool has_particles = std::any_of(&stamp.materials[source], &stamp.materials[source] + run, [](MaterialID material) {
+                return material != MaterialID::Air;
+            });
+
+            if (has_particles) {
+                allocate_chunk({ x >> chunk_shift, y >> chunk_shift });
+            }
+
+            const int index = get_index({ x, y });
+
+            // The cells of slot 0 are shared by every empty chunk and are never written
+            if ((index >> (2 * chunk_shift)) != 0) {
+                for (int i = 0; i < run; i++) {
+                    const MaterialID material = stamp.materials[source + i];
+
+                    if (skip_air and material == MaterialID::Air) {
+                        continue;
+                    }
+
+                    count_changes[(size_t)cell_materials[index + i]]--;
+                    count_changes[(size_t)material]++;
+
+                    cell_materials[index + i] = material;
+                    cell_temps[index + i] = stamp.temps[source + i];
+                    cell_shades[index + i] = stamp.shades[source + i];
+                    cell_motions[index + i] = Motion();
+                    cell_moved_tick[index + i] = tick;
+                }
+            }
+
+            x += run;
+        }
+
+        for (size_t i = 0; i < count_changes.size(); i++) {
+            if (count_changes[i] != 0) {
+                material_counts[i].fetch_add(count_changes[i], std::memory_order_relaxed);
+            }
+        }
+
+        mark_dirty({ min_x, y }, { max_x, y });
+    }
+}
+
+
+void ParticleSimulation::draw_sfml(sf::RenderTarget& target, DisplayMode mode) {
+    PROFILE_SCOPE("draw_sfml");
+
+    CellPlanes cells = get_cell_planes();
+
+    // Only the pyramid needs the stamps, which take a walk over every slot
+    if (camera.get_level() > 0) {
+        fill_chunk_stamps(draw_stamps);
+        cells.chunk_stamps = draw_stamps.data();
+        cells.slot_count = static_cast<int>(draw_stamps.size());
+    }
+
+    draw_cells(target, cells, mode, true);
+}
+
+
+void ParticleSimulation::draw_sfml(sf::RenderTarget& target, const WorldSnapshot& snapshot, DisplayMode mode) {
+    PROFILE_SCOPE("draw_sfml");
+
+    // The thread pool belongs to whichever thread is updating the simulation
+    draw_cells(target, snapshot.get_cell_planes(), mode, false);
+}
+
+
+void ParticleSimulation::draw_cells(sf::RenderTarget& target, const CellPlanes& cells, DisplayMode mode, bool parallel) {
+    PROFILE_SCOPE("draw_cells");
+
+    const sf::IntRect visible = camera.get_visible_cells();
+
+    if (camera.get_level() > 0) {
+        draw_texels(target, cells, mode, visible, parallel);
+        return;
+    }
+
+    renderer.resize(sf::Vector2u(visible.size));
+
+    if (visible.size.x == 0 or visible.size.y == 0) {
+        return;
+    }
+
+    const sf::Vector2i visible_end = visible.position + visible.size;
+    const CellColorizer colorizer(mode, cells.tick);
+
+    // Each task recolors one horizontal band of chunks, so no two tasks ever
+    // write to the same row of the pixel buffer
+    std::vector<sf::Vector2i> bands;
+    for (int y = visible.position.y >> cells.chunk_shift; y <= (visible_end.y - 1) >> cells.chunk_shift; y++) {
+        bands.push_back({ 0, y });
+    }
+
+    auto draw_band = [this, &cells, &colorizer, visible, visible_end](sf::Vector2i band) {
+        const int chunk_size = 1 << cells.chunk_shift;
+
+        thread_local std::vector<sf::Color> colors;
+        colors.resize(chunk_size);
+
+        const int min_y = std::max(visible.position.y, band.y << cells.chunk_shift);
+        const int max_y = std::min(visible_end.y, (band.y << cells.chunk_shift) + chunk_size);
+
+        const int min_chunk_x = visible.position.x >> cells.chunk_shift;
+        const int max_chunk_x = (visible_end.x - 1) >> cells.chunk_shift;
+
+        for (int y = min_y; y < max_y; y++) {
+            for (int chunk_x = min_chunk_x; chunk_x <= max_chunk_x; chunk_x++) {
+                const int x = std::max(visible.position.x, chunk_x << cells.chunk_shift);
+                const int width = std::min((chunk_x << cells.chunk_shift) + chunk_size, visible_end.x) - x;
+                const int first = cells.get_index({ x, y });
+                const sf::Vector2i pixel = sf::Vector2i(x, y) - visible.position;
+
+                const CellRun run = { &cells.materials[first], &cells.temps[first], &cells.shades[first], &cells.moved_ticks[first] };
+                colorizer.colorize(run, colors.data(), width);
+
+                renderer.write(pixel, colors.data(), width);
+            }
+        }
+    };
+
+    if (parallel) {
+        run_on_tiles(bands, draw_band);
+    }
+    else {
+        for (sf::Vector2i band : bands) {
+            draw_band(band);
+        }
+    }
+
+    const int gap = camera.get_gap();
+    renderer.draw(target, camera.world_to_view(sf::Vector2f(visible.position)), camera.get_cell_stride() - gap, gap);
+}
+
+
+void ParticleSimulation::draw_texels(sf::RenderTarget& target, const CellPlanes& cells, DisplayMode mode, sf::IntRect visible, bool parallel) {
+    PROFILE_SCOPE("draw_texels");
+
+    const int level = camera.get_level();
+    const int block = 1 << level;
+
+    const sf::Vector2i min = { visible.position.x >> level, visible.position.y >> level };
+    const sf::Vector2i max = {
+        (visible.position.x + visible.size.x + block - 1) >> level,
+        (visible.position.y + visible.size.y + block - 1) >> level
+    };
+
+    renderer.resize(sf::Vector2u(max - min));
+
+    const CellColorizer colorizer(mode, cells.tick);
+
+    // Colors and temperatures are kept downsampled, the other views show one
+    // cell out of every block, which still reads one cell per pixel
+    const bool downsampled = cells.chunk_stamps and (mode == DisplayMode::Standard or mode == DisplayMode::Temperature);
+
+    if (downsampled) {
+        PROFILE_SCOPE("lod_pyramid");
+        lod_pyramid.update(cells, level, parallel and multithreading_enabled ? thread_pool.get() : nullptr);
+    }
+
+    std::vector<sf::Color> colors(max.x - min.x);
+
+    for (int y = min.y; y < max.y; y++) {
+        int x = min.x;
+
+        while (x < max.x) {
+            if (downsampled) {
+                int count;
+                const TexelRun run = lod_pyramid.get_run(level, { x, y }, count);
+                count = std::min(count, max.x - x);
+
+                colorizer.colorize(run, &colors[x - min.x], count);
+                x += count;
+                continue;
+            }
+
+            const int index = cells.get_index({ x << level, y << level });
+            const CellRun run = { &cells.materials[index], &cells.temps[index], &cells.shades[index], &cells.moved_ticks[index] };
+
+            colorizer.colorize(run, &colors[x - min.x], 1);
+            x++;
+        }
+
+        renderer.write({ 0, y - min.y }, colors.data(), max.x - min.x);
+    }
+
+    renderer.draw(target, camera.world_to_view(sf::Vector2f(min * block)), camera.get_cell_stride() - camera.get_gap(), camera.get_gap());
+}
+
+
+void ParticleSimulation::draw_brush_outline_sfml(sf::RenderWindow& window, int brush_size, sf::Vector2i mouse_pos) {
+    const std::optional<sf::Vector2i> grid = get_cell_at(mouse_pos);
+
+    if (not grid) {
+        return;
+    }
+
+    int half = brush_size / 2;
+
+    sf::Vector2i min = { std::max(0, grid->x - half), std::max(0, grid->y - half) };
+
+    sf::Vector2i max = { std::min(size.x - 1, grid->x + half), std::min(size.y - 1, grid->y + half) };
+
+    const int cell_stride = camera.get_cell_stride();
+    const sf::Vector2f top_left = camera.world_to_view(sf::Vector2f(min));
+    float width = (max.x - min.x + 1) * cell_stride - camera.get_gap();
+    float height = (max.y - min.y + 1) * cell_stride - camera.get_gap();
+
+    sf::RectangleShape outline(sf::Vector2f(width, height));
+    outline.setPosition(top_left);
+    outline.setFillColor(sf::Color::Transparent);
+    outline.setOutlineColor(sf::Color::Red);
+    outline.setOutlineThickness(2.f);
+
+    window.draw(outline);
+}
+
+
+ParticleInformation ParticleSimulation::get_particle_information(sf::Vector2i position) {
+    if (const std::optional<sf::Vector2i> cell = get_cell_at(position)) {
+        return get_cell_planes().get_information(*cell);
+    }
+
+    return ParticleInformation();
+}
+
+
+ParticleInformation ParticleSimulation::get_particle_information(sf::Vector2i position, const WorldSnapshot& snapshot) const {
+    if (const std::optional<sf::Vector2i> cell = get_cell_at(position)) {
+        return snapshot.get_cell_planes().get_information(*cell);
+    }
+
+    return ParticleInformation();
+}
+
+
+std::optional<sf::Vector2i> ParticleSimulation::get_cell_at(sf::Vector2i position) const {
+    const sf::Vector2f world = camera.view_to_world(sf::Vector2f(position));
+
+    const sf::Vector2i cell = {
+        static_cast<int>(std::floor(world.x)),
+        static_cast<int>(std::floor(world.y))
+    };
+
+    if (cell.x < 0 or cell.y < 0 or cell.x >= size.x or cell.y >= size.y) {
+        return std::nullopt;
+    }
+
+    return cell;
+}
+
+
+std::size_t ParticleSimulation::get_particle_count() const {
+    return static_cast<std::size_t>(size.x) * size.y - get_material_count(MaterialID::Air);
+}
+
+
+std::size_t ParticleSimulation::get_material_count(MaterialID material) const {
+    return static_cast<std::size_t>(material_counts[(size_t)material].load(std::memory_order_relaxed));
+}
+
+
+std::array<std::size_t, (size_t)MaterialID::COUNT> ParticleSimulation::get_material_histogram() const {
+    std::array<std::size_t, (size_t)MaterialID::COUNT> histogram;
+
+    for (size_t i = 0; i < histogram.size(); i++) {
+        histogram[i] = get_material_count(static_cast<MaterialID>(i));
+    }
+
+    return histogram;
+}
+
+
+std::array<std::size_t, (size_t)BehaviorID::COUNT> ParticleSimulation::get_behavior_histogram() const {
+    std::array<std::size_t, (size_t)BehaviorID::COUNT> histogram = {};
+
+    for (size_t i = 1; i < (size_t)MaterialID::COUNT; i++) {
+        histogram[(size_t)materials.data[i].behavior] += get_material_count(static_cast<MaterialID>(i));
+    }
+
+    return histogram;
+}
+
+
+std::size_t ParticleSimulation::get_active_chunk_count() const {
+    std::size_t active = 0;
+
+    for (const Chunk& chunk : chunks) {
+        if (chunk.tile.x >= 0 and chunk.next_min_x.load(std::memory_order_relaxed) <= chunk.next_max_x.load(std::memory_order_relaxed)) {
+            active++;
+        }
+    }
+
+    return active;
+}
+
+
+std::size_t ParticleSimulation::get_stored_chunk_count() const {
+    // Slot 0 is shared by every empty chunk and is not counted
+    return chunks.size() - 1 - free_slots.size();
+}
+
+
+std::uint64_t ParticleSimulation::get_seed() const {
+    return seed;
+}
+
+
+std::uint32_t ParticleSimulation::get_tick() const {
+    return tick;
+}
+
+
+sf::Vector2i ParticleSimulation::get_size() const {
+    return size;
+}
+
+
+Camera& ParticleSimulation::get_camera() {
+    return camera;
+}
+
+
+bool ParticleSimulation::is_multithreading_enabled() const {
+    return multithreading_enabled;
+}
+
+
+std::uint64_t ParticleSimulation::get_checksum() const {
+    const int chunk_size = static_cast<int>(multithreading_kernel_size);
+
+    std::vector<sf::Vector2i> tiles;
+    for (const Chunk& chunk : chunks) {
+        if (chunk.tile.x >= 0) {
+            tiles.push_back(chunk.tile);
+        }
+    }
+
+    std::sort(tiles.begin(), tiles.end(), [](sf::Vector2i a, sf::Vector2i b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+    });
+
+    std::uint64_t hash = mix_bits(seed ^ tick);
+
+    // Row by row across the world rather than in storage order. Air is left out,
+    // nothing about it affects the simulation, so it does not matter which chunks
+    // have cells of their own
+    for (std::size_t row_begin = 0; row_begin < tiles.size();) {
+        std::size_t row_end = row_begin;
+        while (row_end < tiles.size() and tiles[row_end].y == tiles[row_begin].y) {
+            row_end++;
+        }
+
+        const int min_y = tiles[row_begin].y * chunk_size;
+        const int max_y = std::min(size.y, min_y + chunk_size);
+
+        for (int y = min_y; y < max_y; y++) {
+            for (std::size_t tile = row_begin; tile < row_end; tile++) {
+                const int x = tiles[tile].x * chunk_size;
+                const int width = std::min(chunk_size, size.x - x);
+                const int first = get_index({ x, y });
+
+                for (int i = 0; i < width; i++) {
+                    if (cell_materials[first + i] == MaterialID::Air) {
+                        continue;
+                    }
+
+                    std::uint32_t temp_bits;
+                    std::memcpy(&temp_bits, &cell_temps[first + i], sizeof(temp_bits));
+
+                    hash = mix_bits(hash ^ ((static_cast<std::uint64_t>(y) << 32) | static_cast<std::uint32_t>(x + i)));
+                    hash = mix_bits(hash ^ ((static_cast<std::uint64_t>(temp_bits) << 32) | cell_shades[first + i])) + static_cast<std::uint64_t>(cell_materials[first + i]);
+                }
+            }
+        }
+
+        row_begin = row_end;
+    }
+
+    return hash;
+}
+
+
+CellPlanes ParticleSimulation::get_cell_planes() const {
+    return { size, chunk_count, chunk_shift, &chunk_table, tick, cell_materials.data(), cell_temps.data(), cell_shades.data(), cell_moved_tick.data() };
+}
+
+
+void ParticleSimulation::capture(WorldSnapshot& snapshot) const {
+    PROFILE_SCOPE("capture");
+
+    const bool full_copy = not snapshot.complete or snapshot.size != size or snapshot.chunk_shift != chunk_shift;
+
+    // Slots handed out since the last capture are stamped with a later version, so growing is enough
+    if (snapshot.materials.size() != cell_materials.size()) {
+        snapshot.materials.resize(cell_materials.size());
+        snapshot.temps.resize(cell_temps.size());
+        snapshot.shades.resize(cell_shades.size());
+        snapshot.moved_ticks.resize(cell_moved_tick.size());
+    }
+
+    fill_chunk_stamps(snapshot.chunk_stamps);
+
+    if (full_copy or snapshot.table_version != table_version) {
+        snapshot.chunk_table = chunk_table;
+        snapshot.table_version = table_version;
+    }
+
+    const std::size_t chunk_cells = std::size_t(1) << (2 * chunk_shift);
+
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        if (not full_copy and chunks[i].changed_version.load(std::memory_order_relaxed) <= snapshot.version) {
+            continue;
+        }
+
+        // Free slots are not in the table, so their cells are never read
+        if (i != 0 and chunks[i].tile.x < 0) {
+            continue;
+        }
+
+        const std::size_t first = i * chunk_cells;
+
+        std::copy_n(&cell_materials[first], chunk_cells, &snapshot.materials[first]);
+        std::copy_n(&cell_temps[first], chunk_cells, &snapshot.temps[first]);
+        std::copy_n(&cell_shades[first], chunk_cells, &snapshot.shades[first]);
+        std::copy_n(&cell_moved_tick[first], chunk_cells, &snapshot.moved_ticks[first]);
+    }
+
+    snapshot.size = size;
+    snapshot.chunk_count = chunk_count;
+    snapshot.chunk_shift = chunk_shift;
+    snapshot.seed = seed;
+    snapshot.tick = tick;
+    snapshot.particle_count = get_particle_count();
+    snapshot.version = change_version;
+    snapshot.complete = true;
+}
+
+
+//////////////////////////////////////////////
+// Private functions for ParticleSimulation //
+//////////////////////////////////////////////
+
+int ParticleSimulation::get_index(sf::Vector2i position) const {
+    return get_chunked_index(position, size, chunk_table, chunk_shift);
+}
+
+
+int ParticleSimulation::get_neighbor_index(sf::Vector2i coordinate, int coordinate_index, sf::Vector2i offset) const {
+    const int chunk_mask = (1 << chunk_shift) - 1;
+    const sf::Vector2i local = { (coordinate.x & chunk_mask) + offset.x, (coordinate.y & chunk_mask) + offset.y };
+
+    // Most neighbors are in the same chunk, whose slot is already known
+    if (local.x < 0 or local.x > chunk_mask or local.y < 0 or local.y > chunk_mask) {
+        return get_index(coordinate + offset);
+    }
+
+    if (coordinate.x + offset.x >= size.x or coordinate.y + offset.y >= size.y) {
+        return -1;
+    }
+
+    return coordinate_index + (offset.y << chunk_shift) + offset.x;
+}
+
+
+sf::Vector2i ParticleSimulation::get_coordinate(int index) const {
+    if (index < 0 or index >= static_cast<int>(cell_materials.size())) {
+        return { -1, -1 };
+    }
+
+    const int chunk_mask = (1 << chunk_shift) - 1;
+    const sf::Vector2i tile = chunks[index >> (2 * chunk_shift)].tile;
+
+    // Slot 0 and free slots stand for no chunk in particular
+    if (tile.x < 0) {
+        return { -1, -1 };
+    }
+
+    const int x = (tile.x << chunk_shift) | (index & chunk_mask);
+    const int y = (tile.y << chunk_shift) | ((index >> chunk_shift) & chunk_mask);
+
+    if (x >= size.x or y >= size.y) {
+        return { -1, -1 };
+    }
+
+    return { x, y };
+}
+
+
+void ParticleSimulation::swap(int index_a, int index_b) {
+    std::swap(cell_materials[index_a], cell_materials[index_b]);
+    std::swap(cell_temps[index_a], cell_temps[index_b]);
+    std::swap(cell_shades[index_a], cell_shades[index_b]);
+    std::swap(cell_motions[index_a], cell_motions[index_b]);
+
+    cell_moved_tick[index_a] = tick;
+    cell_moved_tick[index_b] = tick;
+}
+
+
+void ParticleSimulation::fill_span(int y, int min_x, int max_x, MaterialID material, bool overwrite) {
+    const int chunk_mask = (1 << chunk_shift) - 1;
+
+    // Counted for the whole span and added up once at the end
+    std::array<std::int64_t, (size_t)MaterialID::COUNT> removed = {};
+    std::int64_t added = 0;
+
+    for (int x = min_x; x <= max_x; ) {
+        const int run = std::min(max_x, x | chunk_mask) - x + 1;
+        const sf::Vector2i tile = { x >> chunk_shift, y >> chunk_shift };
+
+        // Air needs no cells of its own, and the cells of slot 0 are shared by every
+        // empty chunk and are never written
+        const std::int32_t slot = material != MaterialID::Air ? allocate_chunk(tile) : chunk_table.get_slot(tile);
+
+        if (slot != 0) {
+            const int first = get_index({ x, y });
+
+            for (int i = 0; i < run; i++) {
+                const int index = first + i;
+                const MaterialID old_material = cell_materials[index];
+
+                if (not overwrite and old_material != MaterialID::Air and material != MaterialID::Air) {
+                    continue;
+                }
+
+                if (old_material != material) {
+                    removed[(size_t)old_material]++;
+                    added++;
+                }
+
+                cell_materials[index] = material;
+                cell_temps[index] = ambient_temp;
+
+                CellRandom random = get_random({ x + i, y }, RandomStream::Brush);
+                cell_shades[index] = random_shade(random);
+                cell_motions[index] = Motion();
+                cell_moved_tick[index] = tick;
+            }
+        }
+
+        x += run;
+    }
+
+    for (size_t i = 0; i < removed.size(); i++) {
+        if (removed[i] != 0) {
+            material_counts[i].fetch_sub(removed[i], std::memory_order_relaxed);
+        }
+    }
+    material_counts[(size_t)material].fetch_add(added, std::memory_order_relaxed);
+
+    mark_dirty({ min_x, y }, { max_x, y });
+}
+
+
+void ParticleSimulation::update_material(sf::Vector2i coordinate, int coordinate_index) {
+    const MaterialID material = cell_materials[coordinate_index];
+    const MaterialRule& rule = material_rules[material];
+    MaterialID new_material = material;
+    float temp = cell_temps[coordinate_index];
+    float launchpad = 5.f;
+
+    // Changes that would keep the material have infinite temperatures, so one comparison each is enough
+    if (temp > rule.high_temp) {
+        new_material = rule.high_new;
+        temp += launchpad;
+    }
+    if (temp < rule.low_temp) {
+        new_material = rule.low_new;
+        temp -= launchpad;
+    }
+
+    if (new_material == material) {
+        return;
+    }
+
+    // The cell keeps its shade, which now picks from the palette of the new material
+    set_material(coordinate_index, new_material);
+    cell_temps[coordinate_index] = temp;
+
+    mark_dirty(coordinate);
+}
+
+
+template <std::uint16_t Directions>
+void ParticleSimulation::update_movement(sf::Vector2i coordinate, int coordinate_index) {
+    static constexpr sf::Vector2i offsets[9] = {
+        { -1, -1 }, { 0, -1 }, { 1, -1 },
+        { -1, 0 }, { 0, 0 }, { 1, 0 },
+        { -1, 1}, { 0, 1 }, { 1, 1 }
+    };
+    static constexpr std::uint16_t stay_bit = 1 << 4;
+    static constexpr std::uint16_t sideways_bits = (1 << 3) | (1 << 5);
+
+    if (cell_moved_tick[coordinate_index] == tick) {
+        return;
+    }
+
+    // Whatever the weights, a cell that can only stay never moves
+    if constexpr ((Directions & ~stay_bit) == 0) {
+        cell_motions[coordinate_index] = Motion();
+        return;
+    }
+
+    const MaterialRule& rule = material_rules[cell_materials[coordinate_index]];
+
+    std::uint16_t valid_moves = 0;
+    std::uint32_t total_weight = 0;
+    int indices[9];
+
+    auto check_direction = [&](int i) {
+        if (((rule.directions >> i) & 1) == 0) {
+            return;
+        }
+
+        if (i != 4) {
+            int index = get_neighbor_index(coordinate, coordinate_index, offsets[i]);
+            if (index == -1) {
+                return;
+            }
+
+            indices[i] = index;
+
+            if (cell_moved_tick[index] == tick) {
+                return;
+            }
+
+            if (not rule.can_displace(cell_materials[index])) {
+                return;
+            }
+        }
+
+        valid_moves |= 1 << i;
+        total_weight += rule.weights[i];
+    };
+
+    // The directions of the kernel are unrolled at compile time, the weights can
+    // still turn some of them off
+    [&]<int... I>(std::integer_sequence<int, I...>) {
+        (((Directions >> I) & 1 ? check_direction(I) : void()), ...);
+    }(std::make_integer_sequence<int, 9>());
+
+    if (valid_moves == 0) {
+        cell_motions[coordinate_index] = Motion();
+        return;
+    }
+
+    // One draw picks a direction with probability weight / total_weight
+    CellRandom random = get_random(coordinate, RandomStream::Movement);
+    std::uint32_t roll = random.next_below(total_weight);
+
+    int move_index = 0;
+    for (std::uint16_t moves = valid_moves; moves != 0; moves &= moves - 1) {
+        move_index = std::countr_zero(moves);
+
+        if (roll < rule.weights[move_index]) {
+            break;
+        }
+        roll -= rule.weights[move_index];
+    }
+
+    const Motion motion = cell_motions[coordinate_index];
+
+    // A particle sliding sideways keeps going that way until it is blocked,
+    // only falling, rising or resting by its stay weight takes it off its heading
+    if constexpr ((Directions & sideways_bits) != 0) {
+        if (motion.heading != 0 and move_index != 4 and offsets[move_index].y == 0) {
+            const int heading_index = 4 + motion.heading;
+
+            if (valid_moves & (1 << heading_index)) {
+                move_index = heading_index;
+            }
+        }
+    }
+
+    if (move_index == 4) {
+        // Don't mark particle as moved when it stayed still, but keep its chunk
+        // awake if it could have gone somewhere else
+        if (valid_moves != stay_bit) {
+            mark_dirty(coordinate);
+        }
+        cell_motions[coordinate_index] = Motion();
+        return;
+    }
+
+    const int speed = motion.speed;
+
+    sf::Vector2i position = coordinate + offsets[move_index];
+    int index = indices[move_index];
+    swap(coordinate_index, index);
+
+    // Past the first cell a particle goes straight up or down when the first move
+    // had a vertical part, sliding on along a diagonal first move where that is
+    // blocked, and sideways otherwise. Cells on the way are displaced under the
+    // same rules as the first one
+    const sf::Vector2i direction = offsets[move_index];
+    const sf::Vector2i straight = direction.y != 0 ? sf::Vector2i(0, direction.y) : direction;
+
+    auto can_enter = [&](int next_index) {
+        return next_index != -1 and cell_moved_tick[next_index] != tick and rule.can_displace(cell_materials[next_index]);
+    };
+
+    int travelled = 1;
+
+    while (travelled < speed) {
+        sf::Vector2i step = straight;
+        int next_index = get_neighbor_index(position, index, step);
+
+        if (not can_enter(next_index) and direction != straight) {
+            step = direction;
+            next_index = get_neighbor_index(position, index, step);
+        }
+
+        if (not can_enter(next_index)) {
+            break;
+        }
+
+        swap(index, next_index);
+        position += step;
+        index = next_index;
+        travelled++;
+    }
+
+    // Moving freely speeds a particle up, running into something halves its speed
+    // and ends its heading
+    Motion& moved = cell_motions[index];
+
+    if (travelled < speed) {
+        moved.speed = static_cast<std::uint8_t>(std::max(1, speed / 2));
+        moved.heading = 0;
+    }
+    else {
+        moved.speed = static_cast<std::uint8_t>(std::min<int>(speed + 1, max_speed));
+        moved.heading = static_cast<std::int8_t>(direction.y == 0 ? direction.x : 0);
+    }
+
+    mark_dirty({ std::min(coordinate.x, position.x), std::min(coordinate.y, position.y) }, { std::max(coordinate.x, position.x), std::max(coordinate.y, position.y) });
+}
+
+
+void ParticleSimulation::update_reactions(sf::Vector2i coordinate, int coordinate_index) {
+    static constexpr sf::Vector2i offsets[4] = { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } };
+
+    // A cell changes at most once per step, like with movement
+    if (cell_moved_tick[coordinate_index] == tick) {
+        return;
+    }
+
+    const MaterialID material = cell_materials[coordinate_index];
+    const MaterialRule& rule = material_rules[material];
+
+    std::uint32_t neighbor_materials = 0;
+    int indices[4];
+
+    for (int i = 0; i < 4; i++) {
+        indices[i] = get_neighbor_index(coordinate, coordinate_index, offsets[i]);
+
+        if (indices[i] != -1) {
+            neighbor_materials |= 1u << (size_t)cell_materials[indices[i]];
+        }
+    }
+
+    if ((neighbor_materials & rule.reacts_with) == 0) {
+        return;
+    }
+
+    CellRandom random = get_random(coordinate, RandomStream::Reaction);
+
+    for (int i = 0; i < 4; i++) {
+        const int index = indices[i];
+
+        if (index == -1 or cell_moved_tick[index] == tick) {
+            continue;
+        }
+
+        const MaterialID neighbor = cell_materials[index];
+        if (not rule.can_react(neighbor)) {
+            continue;
+        }
+
+        const Reaction& reaction = reactions[material][neighbor];
+        if (random.next_float() >= reaction.probability) {
+            continue;
+        }
+
+        const float temp = (cell_temps[coordinate_index] + cell_temps[index]) / 2.f + reaction.heat;
+
+        // Like with state changes both cells keep their shades
+        set_material(coordinate_index, reaction.product);
+        set_material(index, reaction.neighbor_product);
+
+        cell_temps[coordinate_index] = temp;
+        cell_temps[index] = temp;
+
+        cell_moved_tick[coordinate_index] = tick;
+        cell_moved_tick[index] = tick;
+
+        mark_dirty(coordinate);
+        mark_dirty(coordinate + offsets[i]);
+        return;
+    }
+}
+
+
+void ParticleSimulation::update_serial() {
+    PROFILE_SCOPE("update_particles");
+
+    // Awake chunks are sorted bottom row first, so going through them one chunk row at
+    // a time visits cells in the same order as walking the whole grid from the bottom up
+    for (std::size_t row_begin = 0; row_begin < awake_tiles.size();) {
+        std::size_t row_end = row_begin;
+        while (row_end < awake_tiles.size() and awake_tiles[row_end].y == awake_tiles[row_begin].y) {
+            row_end++;
+        }
 
+        const int min_y = awake_tiles[row_begin].y << chunk_shift;
+        const int max_y = std::min(size.y, min_y + static_cast<int>(multithreading_kernel_size)) - 1;
 
-/////////////////////////////////////////////
-// Public functions for ParticleSimulation //
-/////////////////////////////////////////////
+        for (int y = max_y; y >= min_y; y--) {
+            for (std::size_t tile = row_begin; tile < row_end; tile++) {
+                const Chunk& chunk = get_chunk(awake_tiles[tile]);
 
-ParticleSimulation::ParticleSimulation(sf::Vector2i size) : size(size) {
-    unsigned int thread_count = std::thread::hardware_concurrency();
-    multithreading_core_count = thread_count ? thread_count : 4;
+                if (y < chunk.dirty_min.y or y > chunk.dirty_max.y) {
+                    continue;
+                }
+
+                // A dirty rect never leaves its chunk, so its rows are contiguous
+                const int first = get_index({ chunk.dirty_min.x, y }) - chunk.dirty_min.x;
+
+                for (int x = chunk.dirty_min.x; x <= chunk.dirty_max.x; x++) {
+                    sf::Vector2i pos{x, y};
 
-    size_t len = size.x * size.y;
-    particle_layers.resize(len);
+                    update_particle(pos, first + x);
+                }
+            }
+        }
 
-    for (int i = 0; i < len; i++) {
-        Particle particle;
-        particle.temp = 20;
-        particle.material = MaterialID::Air;
-        particle_layers[i] = particle;
+        row_begin = row_end;
     }
 }
 
 
-void ParticleSimulation::update() {
-    for (Particle& particle : particle_layers) {
-        particle.moved = false;
-    }
+void ParticleSimulation::update_parallel() {
+    PROFILE_SCOPE("update_particles");
+
+    // Tiles are split into a 2x2 checkerboard. Tiles of the same phase are a
+    // whole tile apart and particles travel at most half a tile, so they can
+    // move across tile borders without ever reaching a cell another worker is touching.
+    std::vector<sf::Vector2i> phase_tiles;
 
-    for (int y = size.y - 1; y >= 0; y--) {
-        for (int x = 0; x < size.x; x++) {
-            sf::Vector2i pos{x, y};
+    for (int phase = 0; phase < 4; phase++) {
+        phase_tiles.clear();
 
-           update_particle(pos);
+        for (sf::Vector2i tile : awake_tiles) {
+            if ((tile.x & 1) + 2 * (tile.y & 1) == phase) {
+                phase_tiles.push_back(tile);
+            }
         }
+
+        run_on_tiles(phase_tiles, [this](sf::Vector2i tile) {
+            update_tile(tile);
+        });
     }
 }
 
 
-void ParticleSimulation::brush(int brush_size, sf::Vector2i position, MaterialID material) {
-    int cell_stride = cell_px + gap;
+void ParticleSimulation::update_thermal() {
+    PROFILE_SCOPE("update_thermal");
 
-    if (position.x < 0 or position.y < 0 or position.x > size.x * cell_stride or position.y > size.y * cell_stride) {
-        return;
+    // Every chunk reads the old temperatures and writes into cell_temps_next,
+    // so the result does not depend on which chunk or cell goes first
+    run_on_tiles(awake_tiles, [this](sf::Vector2i tile) {
+        diffuse_tile(tile);
+    });
+
+    run_on_tiles(awake_tiles, [this](sf::Vector2i tile) {
+        const Chunk& chunk = get_chunk(tile);
+        const std::size_t width = chunk.dirty_max.x - chunk.dirty_min.x + 1;
+
+        for (int y = chunk.dirty_min.y; y <= chunk.dirty_max.y; y++) {
+            const int index = get_index({ chunk.dirty_min.x, y });
+            std::copy_n(&cell_temps_next[index], width, &cell_temps[index]);
+        }
+    });
+
+    if (thermal_coarse_interval != 0 and tick % thermal_coarse_interval == 0) {
+        update_coarse_thermal();
     }
+}
 
-    sf::Vector2i grid = position / cell_stride;
-    int half = brush_size / 2;
 
-    for (int i = -half; i <= half; ++i) {
-        for (int j = -half; j <= half; ++j) {
-            int x = grid.x + i;
-            int y = grid.y + j;
+// Neighbor offsets of the coarse thermal pass, indexed like Chunk::coarse_solid
+static const std::array<sf::Vector2i, 4> coarse_sides = { sf::Vector2i(1, 0), sf::Vector2i(0, 1), sf::Vector2i(-1, 0), sf::Vector2i(0, -1) };
 
-            if (x < 0 or x >= size.x or y < 0 or y >= size.y) {
+
+void ParticleSimulation::update_coarse_thermal() {
+    PROFILE_SCOPE("update_coarse_thermal");
+
+    // Chunks of empty air hold no heat, the others around an awake chunk can take or give some
+    coarse_tiles.clear();
+
+    for (sf::Vector2i tile : awake_tiles) {
+        for (sf::Vector2i offset : { sf::Vector2i(0, 0), sf::Vector2i(-1, 0), sf::Vector2i(1, 0), sf::Vector2i(0, -1), sf::Vector2i(0, 1) }) {
+            const sf::Vector2i neighbor = tile + offset;
+
+            if (neighbor.x < 0 or neighbor.y < 0 or neighbor.x >= chunk_count.x or neighbor.y >= chunk_count.y) {
                 continue;
             }
 
-            int index = get_index({x, y});
+            const std::int32_t slot = chunk_table.get_slot(neighbor);
 
-            if (x >= 0 and x < size.x and y >= 0 and y < size.y and (particle_layers[index].material == MaterialID::Air or material == MaterialID::Air)) {
-                particle_layers[index].temp = 20.0;
-                particle_layers[index].material = material;
-
-                particle_layers[index].color = random_color(material);
+            if (slot != 0 and chunks[slot].coarse_tick != tick) {
+                chunks[slot].coarse_tick = tick;
+                coarse_tiles.push_back(neighbor);
             }
         }
     }
+
+    // Every chunk only writes its own cells and reads the sums gathered before,
+    // so the result does not depend on which chunk goes first
+    run_on_tiles(coarse_tiles, [this](sf::Vector2i tile) {
+        gather_coarse_tile(tile);
+    });
+
+    run_on_tiles(coarse_tiles, [this](sf::Vector2i tile) {
+        relax_coarse_tile(tile);
+    });
 }
 
 
-void ParticleSimulation::draw_sfml(sf::RenderTarget& target, bool use_temp_coloring) {
-    const int grid_size_x = size.x;
-    const int grid_size_y = size.y;
+void ParticleSimulation::gather_coarse_tile(sf::Vector2i tile) {
+    thread_local std::vector<std::uint8_t> reach;
+    reach_coarse_borders(tile, reach);
 
-    sf::RectangleShape cell(sf::Vector2f(
-        static_cast<float>(cell_px),
-        static_cast<float>(cell_px)
-    ));
+    const int first = get_index({ tile.x << chunk_shift, tile.y << chunk_shift });
 
-    for (int i = 0; i < grid_size_x; ++i) {
-        for (int j = 0; j < grid_size_y; ++j) {
-            sf::Color color;
-            if (use_temp_coloring) {
-                if (particle_layers[get_index({i,j})].material == MaterialID::Air) {
-                    color = particle_layers[get_index({i,j})].color;
-                }
-                else {
-                    float t = particle_layers[get_index({i, j})].temp;
-
-                    if (t <= 0.0f) {
-                        // Purple fades to black as it gets colder
-                        float ratio = (t + 273.0f) / 273.0f; // maps [-273, 0] → [0, 1]
-                        unsigned char r = static_cast<unsigned char>(75 * ratio);  // from 0 to 75
-                        unsigned char g = static_cast<unsigned char>(0);
-                        unsigned char b = static_cast<unsigned char>(130 * ratio); // from 0 to 130
-                        color = sf::Color(r, g, b);
-                    }
-                    else if (t <= 1000.0f) {
-                        // Black to Red
-                        float ratio = t / 1000.0f;
-                        color = sf::Color(
-                            static_cast<unsigned char>(255 * ratio),
-                            0,
-                            255
-                        );
-                    }
-                    else if (t <= 2000.0f) {
-                        // Red to Yellow (increasing green)
-                        float ratio = (t - 1000.0f) / 1000.0f;
-                        color = sf::Color(
-                            255,
-                            static_cast<unsigned char>(255 * ratio),
-                            0
-                        );
-                    }
-                    else {
-                        // Yellow to White (increasing blue)
-                        float ratio = (t - 2000.0f) / 1000.0f;
-                        color = sf::Color(
-                            255,
-                            255,
-                            static_cast<unsigned char>(255 * ratio)
-                        );
-                    }
-                }
+    std::array<float, 4> sum = {};
+    std::array<int, 4> solid = {};
 
+    for (std::size_t i = 0; i < reach.size(); i++) {
+        for (int side = 0; side < 4; side++) {
+            if (reach[i] & (1 << side)) {
+                sum[side] += cell_temps[first + i];
+                solid[side]++;
             }
-            else {
-                color = particle_layers[get_index({i,j})].color;
+        }
+    }
+
+    Chunk& chunk = get_chunk(tile);
+
+    for (int side = 0; side < 4; side++) {
+        chunk.coarse_solid[side] = static_cast<float>(solid[side]);
+        chunk.coarse_average[side] = solid[side] ? sum[side] / solid[side] : 0.f;
+    }
+
+    chunk.coarse_contact_right = count_coarse_contact(tile, { 1, 0 });
+    chunk.coarse_contact_down = count_coarse_contact(tile, { 0, 1 });
+}
+
+
+float ParticleSimulation::count_coarse_contact(sf::Vector2i tile, sf::Vector2i offset) const {
+    const sf::Vector2i neighbor = tile + offset;
+
+    if (neighbor.x >= chunk_count.x or neighbor.y >= chunk_count.y) {
+        return 0.f;
+    }
+
+    const std::int32_t slot = chunk_table.get_slot(tile);
+    const std::int32_t neighbor_slot = chunk_table.get_slot(neighbor);
+
+    // Two chunks that are both asleep have nothing to even out
+    if (neighbor_slot == 0 or chunks[neighbor_slot].coarse_tick != tick) {
+        return 0.f;
+    }
+    if (not chunks[slot].is_awake() and not chunks[neighbor_slot].is_awake()) {
+        return 0.f;
+    }
+
+    const int chunk_size = 1 << chunk_shift;
+    const int first = slot << (2 * chunk_shift);
+    const int neighbor_first = neighbor_slot << (2 * chunk_shift);
+
+    // The last column or row of this chunk against the first one of the neighbor
+    const int step = offset.x ? chunk_size : 1;
+    const int edge = offset.x ? chunk_size - 1 : (chunk_size - 1) << chunk_shift;
+
+    int contact = 0;
+
+    for (int i = 0; i < chunk_size; i++) {
+        const int own = first + edge + i * step;
+        const int other = neighbor_first + i * step;
+
+        if (cell_materials[own] != MaterialID::Air and cell_materials[other] != MaterialID::Air) {
+            contact++;
+        }
+    }
+
+    return static_cast<float>(contact);
+}
+
+
+void ParticleSimulation::reach_coarse_borders(sf::Vector2i tile, std::vector<std::uint8_t>& reach) const {
+    const int chunk_size = 1 << chunk_shift;
+    const int first = chunk_table.get_slot(tile) << (2 * chunk_shift);
+
+    thread_local std::vector<int> stack;
+
+    // Bit side of a cell is set when it touches a non air cell of the neighbor across
+    // that border, or touches such a cell of its own chunk through other non air cells.
+    // Air stays insulating, heat never jumps to a body the neighbor does not touch
+    reach.assign(std::size_t(1) << (2 * chunk_shift), 0);
+
+    for (int side = 0; side < 4; side++) {
+        const sf::Vector2i offset = coarse_sides[side];
+        const sf::Vector2i neighbor = tile + offset;
+
+        if (neighbor.x < 0 or neighbor.y < 0 or neighbor.x >= chunk_count.x or neighbor.y >= chunk_count.y) {
+            continue;
+        }
+
+        const std::int32_t neighbor_slot = chunk_table.get_slot(neighbor);
+
+        if (neighbor_slot == 0 or chunks[neighbor_slot].coarse_tick != tick) {
+            continue;
+        }
+
+        const int neighbor_first = neighbor_slot << (2 * chunk_shift);
+        const std::uint8_t bit = static_cast<std::uint8_t>(1 << side);
+
+        stack.clear();
+
+        for (int i = 0; i < chunk_size; i++) {
+            // The cell on this border and the one across it in the neighbor
+            const sf::Vector2i own = offset.x ? sf::Vector2i(offset.x > 0 ? chunk_size - 1 : 0, i) : sf::Vector2i(i, offset.y > 0 ? chunk_size - 1 : 0);
+            const sf::Vector2i across = own - offset * (chunk_size - 1);
+
+            const int local = (own.y << chunk_shift) + own.x;
+
+            if (cell_materials[first + local] != MaterialID::Air and cell_materials[neighbor_first + (across.y << chunk_shift) + across.x] != MaterialID::Air) {
+                reach[local] |= bit;
+                stack.push_back(local);
             }
+        }
 
-            cell.setPosition(
-                sf::Vector2f(
-                    static_cast<float>(i * (cell_px + gap)),
-                    static_cast<float>(j * (cell_px + gap))
-                )
-            );
-            cell.setFillColor(color);
-            target.draw(cell);
+        while (not stack.empty()) {
+            const int local = stack.back();
+            stack.pop_back();
+
+            const sf::Vector2i cell = { local & (chunk_size - 1), local >> chunk_shift };
+
+            for (sf::Vector2i step : coarse_sides) {
+                const sf::Vector2i next = cell + step;
+
+                if (next.x < 0 or next.y < 0 or next.x >= chunk_size or next.y >= chunk_size) {
+                    continue;
+                }
+
+                const int next_local = (next.y << chunk_shift) + next.x;
+
+                if (not (reach[next_local] & bit) and cell_materials[first + next_local] != MaterialID::Air) {
+                    reach[next_local] |= bit;
+                    stack.push_back(next_local);
+                }
+            }
         }
     }
 }
 
 
-void ParticleSimulation::draw_brush_outline_sfml(sf::RenderWindow& window, int brush_size, sf::Vector2i mouse_pos) {
-    int cell_stride = cell_px + gap;
+void ParticleSimulation::relax_coarse_tile(sf::Vector2i tile) {
+    // A border moves its cells at most a quarter of the way, so even a cell reached from all
+    // four borders ends up somewhere between its own temperature and the targets
+    static const float coarse_transfer = 0.25f;
+
+    const Chunk& chunk = get_chunk(tile);
+
+    std::array<float, 4> fraction = {};
+    std::array<float, 4> target = {};
+    bool exchanging = false;
+
+    for (int side = 0; side < 4; side++) {
+        const sf::Vector2i neighbor = tile + coarse_sides[side];
+
+        if (neighbor.x < 0 or neighbor.y < 0 or neighbor.x >= chunk_count.x or neighbor.y >= chunk_count.y or chunk.coarse_solid[side] == 0.f) {
+            continue;
+        }
+
+        const Chunk& other = chunks[chunk_table.get_slot(neighbor)];
 
-    if (mouse_pos.x < 0 or mouse_pos.y < 0 or mouse_pos.x > size.x * cell_stride or mouse_pos.y > size.y * cell_stride) {
+        // The cells the neighbor reaches from its side of the same border
+        const int opposite = (side + 2) % 4;
+
+        // Both chunks of a pair skip it alike, so no heat is lost or made
+        if (other.coarse_tick != tick or std::abs(other.coarse_average[opposite] - chunk.coarse_average[side]) <= temp_sleep_threshold) {
+            continue;
+        }
+
+        const float pair_contact = side == 0 ? chunk.coarse_contact_right : side == 1 ? chunk.coarse_contact_down
+            : side == 2 ? other.coarse_contact_right : other.coarse_contact_down;
+
+        fraction[side] = coarse_transfer * pair_contact / chunk.coarse_solid[side];
+        target[side] = other.coarse_average[opposite];
+        exchanging = exchanging or pair_contact != 0.f;
+    }
+
+    if (not exchanging) {
         return;
     }
 
-    sf::Vector2i grid = mouse_pos / cell_stride;
-    int half = brush_size / 2;
+    thread_local std::vector<std::uint8_t> reach;
+    reach_coarse_borders(tile, reach);
 
-    sf::Vector2i min = { std::max(0, grid.x - half), std::max(0, grid.y - half) };
+    // The cells reached from a border move the same fraction of the way to the average
+    // of the cells reached from the neighbor's side. Those then gain exactly what the
+    // neighbor's lose, and no cell goes past a temperature that was already there
+    const int chunk_size = 1 << chunk_shift;
+    const int first = get_index({ tile.x << chunk_shift, tile.y << chunk_shift });
 
-    sf::Vector2i max = { std::min(size.x - 1, grid.x + half), std::min(size.y - 1, grid.y + half) };
+    sf::Vector2i changed_min = { chunk_size, chunk_size };
+    sf::Vector2i changed_max = { -1, -1 };
 
-    float left = min.x * cell_stride;
-    float top = min.y * cell_stride;
-    float width = (max.x - min.x + 1) * cell_stride - gap;
-    float height = (max.y - min.y + 1) * cell_stride - gap;
+    for (int y = 0; y < chunk_size; y++) {
+        for (int x = 0; x < chunk_size; x++) {
+            const int local = (y << chunk_shift) + x;
 
-    sf::RectangleShape outline(sf::Vector2f(width, height));
-    outline.setPosition(sf::Vector2f(static_cast<float>(left),static_cast<float>(top)));
-    outline.setFillColor(sf::Color::Transparent);
-    outline.setOutlineColor(sf::Color::Red);
-    outline.setOutlineThickness(2.f);
+            if (reach[local] == 0) {
+                continue;
+            }
 
-    window.draw(outline);
+            const int index = first + local;
+            float delta = 0.f;
+
+            for (int side = 0; side < 4; side++) {
+                if (reach[local] & (1 << side)) {
+                    delta += fraction[side] * (target[side] - cell_temps[index]);
+                }
+            }
+
+            cell_temps[index] += delta;
+
+            if (std::abs(delta) > temp_sleep_threshold) {
+                changed_min = { std::min(changed_min.x, x), std::min(changed_min.y, y) };
+                changed_max = { std::max(changed_max.x, x), std::max(changed_max.y, y) };
+            }
+        }
+    }
+
+    if (changed_max.x >= 0) {
+        const sf::Vector2i origin = { tile.x << chunk_shift, tile.y << chunk_shift };
+        mark_dirty(origin + changed_min, origin + changed_max);
+    }
 }
 
 
-ParticleInformation ParticleSimulation::get_particle_information(sf::Vector2i position) {
-    int cell_stride = cell_px + gap;
-    
-    sf::Vector2i mouse_pos_grid = position / cell_stride;
+void ParticleSimulation::diffuse_tile(sf::Vector2i tile) {
+    PROFILE_SCOPE("diffuse_tile");
+
+    static const float temp_transfer = 0.1f;
+
+    const Chunk& chunk = get_chunk(tile);
+    const int width = chunk.dirty_max.x - chunk.dirty_min.x + 1;
+    const int height = chunk.dirty_max.y - chunk.dirty_min.y + 1;
+    const int stride = width + 2;
+
+    // The dirty rect plus a one cell border, with air and cells outside the world masked out
+    thread_local std::vector<float> heat;
+    thread_local std::vector<float> solid;
+
+    heat.assign(stride * (height + 2), 0.0f);
+    solid.assign(stride * (height + 2), 0.0f);
+
+    auto gather = [&](int index, int padded_index) {
+        const bool is_solid = cell_materials[index] != MaterialID::Air;
+        solid[padded_index] = is_solid ? 1.0f : 0.0f;
+        heat[padded_index] = is_solid ? cell_temps[index] : 0.0f;
+    };
+
+    for (int row = 0; row < height + 2; row++) {
+        const int y = chunk.dirty_min.y - 1 + row;
+
+        // The rect never spans more than one chunk column, so its cells are
+        // contiguous in every row, above and below included
+        const int first = get_index({ chunk.dirty_min.x, y });
+        if (first == -1) {
+            continue;
+        }
+
+        for (int x = 0; x < width; x++) {
+            gather(first + x, row * stride + x + 1);
+        }
 
-    int index = get_index(mouse_pos_grid);
+        const int left = get_index({ chunk.dirty_min.x - 1, y });
+        if (left != -1) {
+            gather(left, row * stride);
+        }
 
-    if (index == -1) {
-        return ParticleInformation();
+        const int right = get_index({ chunk.dirty_max.x + 1, y });
+        if (right != -1) {
+            gather(right, row * stride + width + 1);
+        }
     }
 
-    Particle particle = particle_layers[index];
+    for (int row = 1; row <= height; row++) {
+        const int y = chunk.dirty_min.y - 1 + row;
+        const int first = get_index({ chunk.dirty_min.x, y });
 
-    ParticleInformation info;
-    info.valid_particle = true;
-    info.material_name = materials[particle.material].identifier;
-    info.behavior_name = behaviors[materials[particle.material].behavior].identifier;
-    info.temp = particle.temp;
+        const float* const heat_rows[3] = {
+            &heat[(row - 1) * stride + 1], &heat[row * stride + 1], &heat[(row + 1) * stride + 1]
+        };
+        const float* const solid_rows[3] = {
+            &solid[(row - 1) * stride + 1], &solid[row * stride + 1], &solid[(row + 1) * stride + 1]
+        };
 
-    return info;
-}
+        const float max_delta = diffuse_heat_row(heat_rows, solid_rows, &cell_temps[first], &cell_temps_next[first], width, temp_transfer);
+
+        if (max_delta <= temp_sleep_threshold) {
+            continue;
+        }
+
+        // Wake up only the part of the row that actually changed
+        int changed_min = width;
+        int changed_max = -1;
+
+        for (int x = 0; x < width; x++) {
+            if (std::abs(cell_temps_next[first + x] - cell_temps[first + x]) > temp_sleep_threshold) {
+                changed_min = std::min(changed_min, x);
+                changed_max = x;
+            }
+        }
 
+        mark_dirty({ chunk.dirty_min.x + changed_min, y }, { chunk.dirty_min.x + changed_max, y });
+    }
+}
 
-std::size_t ParticleSimulation::get_particle_count() {
-    std::size_t particle_count = 0;
 
-    for (const Particle& particle : particle_layers) {
-        if (particle.material != MaterialID::Air) {
-            particle_count++;
+template <typename Task>
+void ParticleSimulation::run_on_tiles(const std::vector<sf::Vector2i>& tiles, Task&& task) {
+    if (not multithreading_enabled or multithreading_core_count <= 1) {
+        for (sf::Vector2i tile : tiles) {
+            task(tile);
         }
+        return;
     }
 
-    return particle_count;
+    // Tiles differ a lot in cost, one tile per grain lets idle workers steal the slow ones
+    thread_pool->parallel_for(0, tiles.size(), 1, [&tiles, &task](std::size_t i) {
+        task(tiles[i]);
+    });
 }
 
 
-//////////////////////////////////////////////
-// Private functions for ParticleSimulation //
-//////////////////////////////////////////////
+void ParticleSimulation::create_thread_pool() {
+    // The thread calling update() works on tiles too, so it counts as one of the cores
+    thread_pool.reset();
+    thread_pool = std::make_unique<ThreadPool>(multithreading_core_count - 1, multithreading_pin_threads);
+}
 
-int ParticleSimulation::get_index(sf::Vector2i position) const {
-    if (position.x < 0 or position.x >= size.x or position.y < 0 or position.y >= size.y) {
-        return -1;
+
+void ParticleSimulation::update_tile(sf::Vector2i tile) {
+    PROFILE_SCOPE("update_tile");
+
+    const Chunk& chunk = get_chunk(tile);
+
+    for (int y = chunk.dirty_max.y; y >= chunk.dirty_min.y; y--) {
+        const int first = get_index({ chunk.dirty_min.x, y }) - chunk.dirty_min.x;
+
+        for (int x = chunk.dirty_min.x; x <= chunk.dirty_max.x; x++) {
+            update_particle({x, y}, first + x);
+        }
     }
+}
 
-    return position.y * size.x + position.x;
+
+ParticleSimulation::Chunk& ParticleSimulation::get_chunk(sf::Vector2i tile) {
+    return chunks[chunk_table.get_slot(tile)];
 }
 
 
-sf::Vector2i ParticleSimulation::get_coordinate(int index) const {
-    if (index < 0 or index >= size.x * size.y) {
-        return { -1, -1 };
+std::int32_t ParticleSimulation::allocate_chunk(sf::Vector2i tile) {
+    const std::int32_t existing = chunk_table.get_slot(tile);
+
+    if (existing != 0) {
+        return existing;
     }
 
-    const int x = index % size.x;
-    const int y = index / size.x;
-    return { x, y };
+    std::int32_t slot;
+
+    if (not free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else {
+        slot = static_cast<std::int32_t>(chunks.size());
+        chunks.emplace_back();
+
+        const std::size_t len = (static_cast<std::size_t>(slot) + 1) << (2 * chunk_shift);
+
+        cell_materials.resize(len, MaterialID::Air);
+        cell_temps.resize(len, ambient_temp);
+        cell_temps_next.resize(len, ambient_temp);
+        cell_shades.resize(len, 0);
+        cell_motions.resize(len, Motion());
+        cell_moved_tick.resize(len, 0);
+    }
+
+    // The cells are already air, which the counts include, only the chunk needs setting up
+    Chunk& chunk = chunks[slot];
+    chunk.tile = tile;
+    chunk.changed_version.store(change_version, std::memory_order_relaxed);
+    chunk.checked_version = UINT64_MAX;
+
+    chunk_table.set_slot(tile, slot);
+    table_version++;
+
+    return slot;
 }
 
 
-std::vector<sf::Vector2i> ParticleSimulation::get_surroundings(sf::Vector2i pos) const {
-    static const sf::Vector2i offsets[8] = {
-        {-1, -1}, {0, -1}, {1, -1},
-        {-1,  0},          {1,  0},
-        {-1,  1}, {0,  1}, {1,  1}
-    };
+void ParticleSimulation::allocate_chunks(sf::Vector2i min, sf::Vector2i max) {
+    min = { std::max(0, min.x), std::max(0, min.y) };
+    max = { std::min(size.x - 1, max.x), std::min(size.y - 1, max.y) };
 
-    std::vector<sf::Vector2i> neighbors;
-    for (int i = 0; i < 8; i++) {
-        sf::Vector2i new_position = pos + offsets[i];
-        if (new_position.x >= 0 and new_position.x < size.x and new_position.y >= 0 and new_position.y < size.y) {
-            neighbors.push_back(new_position);
+    if (min.x > max.x or min.y > max.y) {
+        return;
+    }
+
+    for (int chunk_y = min.y >> chunk_shift; chunk_y <= max.y >> chunk_shift; chunk_y++) {
+        for (int chunk_x = min.x >> chunk_shift; chunk_x <= max.x >> chunk_shift; chunk_x++) {
+            allocate_chunk({ chunk_x, chunk_y });
         }
     }
-    return neighbors;
 }
 
 
-void ParticleSimulation::swap(sf::Vector2i a, sf::Vector2i b) {
-    const int index_a = get_index(a);
-    const int index_b = get_index(b);
+void ParticleSimulation::release_chunk(std::int32_t slot) {
+    Chunk& chunk = chunks[slot];
+
+    chunk_table.set_slot(chunk.tile, 0);
+    chunk.tile = { -1, -1 };
+    table_version++;
 
-    const Particle particle_a = particle_layers[index_a];
+    // Only air at ambient temperature is released, so the slot just needs the
+    // leftovers of moving air cleared before it is handed out again
+    const std::size_t chunk_cells = std::size_t(1) << (2 * chunk_shift);
+    const std::size_t first = static_cast<std::size_t>(slot) * chunk_cells;
 
-    particle_layers[index_a] = particle_layers[index_b];
-    particle_layers[index_b] = particle_a;
-    particle_layers[index_a].moved = true;
-    particle_layers[index_b].moved = true;
+    std::fill_n(&cell_shades[first], chunk_cells, 0);
+    std::fill_n(&cell_motions[first], chunk_cells, Motion());
+    std::fill_n(&cell_moved_tick[first], chunk_cells, 0);
+
+    free_slots.push_back(slot);
 }
 
 
-void ParticleSimulation::update_temp(Particle& particle, int coordinate_index, std::vector<sf::Vector2i>& surroundings) {
-    static const float temp_transfer = 0.1f;
-    float delta = 0.0f;
+void ParticleSimulation::fill_chunk_stamps(std::vector<ChunkStamp>& stamps) const {
+    stamps.resize(chunks.size());
+
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        stamps[i] = { chunks[i].tile, chunks[i].changed_version.load(std::memory_order_relaxed) };
+    }
+}
+
 
-    for (const sf::Vector2i& coords : surroundings) {
-        int extern_index = get_index({ coords.x, coords.y });
+void ParticleSimulation::release_empty_chunks() {
+    for (std::size_t slot = 1; slot < chunks.size(); slot++) {
+        Chunk& chunk = chunks[slot];
 
-        if (particle_layers[extern_index].material == MaterialID::Air) {
+        if (chunk.tile.x < 0 or chunk.is_awake()) {
             continue;
         }
 
-        float extern_temp = particle_layers[extern_index].temp;
+        // Cells never change without their chunk being stamped, so a chunk is
+        // only looked at again after it changed
+        const std::uint64_t version = chunk.changed_version.load(std::memory_order_relaxed);
 
-        delta += temp_transfer * (extern_temp - particle.temp);
-    }
+        if (chunk.checked_version != version) {
+            chunk.empty = is_chunk_empty(static_cast<std::int32_t>(slot));
+            chunk.checked_version = version;
+        }
 
-    particle_layers[coordinate_index].temp = particle.temp + delta;
-    particle_layers[coordinate_index].temp = std::clamp(particle_layers[coordinate_index].temp, -273.0f, 5000.0f);
+        // Particles next to an awake chunk may move into it this step
+        if (chunk.empty and not has_awake_neighbor(chunk.tile)) {
+            release_chunk(static_cast<std::int32_t>(slot));
+        }
+    }
 }
 
 
-void ParticleSimulation::update_material(Particle& particle, int coordinate_index) {
-    MaterialID new_material = particle.material;
-    float launchpad = 5.f;
+bool ParticleSimulation::is_chunk_empty(std::int32_t slot) const {
+    const std::size_t chunk_cells = std::size_t(1) << (2 * chunk_shift);
+    const std::size_t first = static_cast<std::size_t>(slot) * chunk_cells;
 
-    if ((particle.temp > materials[particle.material].state_change_high_temp) and (materials[particle.material].state_change_high_new != particle.material)) {
-        new_material = materials[particle.material].state_change_high_new;
-        particle.temp += launchpad;
-        
+    for (std::size_t i = first; i < first + chunk_cells; i++) {
+        if (cell_materials[i] != MaterialID::Air or cell_temps[i] != ambient_temp) {
+            return false;
+        }
     }
-    if ((particle.temp < materials[particle.material].state_change_low_temp) and (materials[particle.material].state_change_low_new != particle.material)) {
-        new_material = materials[particle.material].state_change_low_new;
-        particle.temp -= launchpad;
+
+    return true;
+}
+
+
+bool ParticleSimulation::has_awake_neighbor(sf::Vector2i tile) {
+    for (int y = std::max(0, tile.y - 1); y <= std::min(chunk_count.y - 1, tile.y + 1); y++) {
+        for (int x = std::max(0, tile.x - 1); x <= std::min(chunk_count.x - 1, tile.x + 1); x++) {
+            if (get_chunk({ x, y }).is_awake()) {
+                return true;
+            }
+        }
     }
 
-    if (new_material == particle.material) {
+    return false;
+}
+
+
+void ParticleSimulation::mark_dirty(sf::Vector2i position) {
+    mark_dirty(position, position);
+}
+
+
+void ParticleSimulation::mark_dirty(sf::Vector2i min, sf::Vector2i max) {
+    // Changes are visible to the direct neighbors, so they get woken up too
+    min = { std::max(0, min.x - 1), std::max(0, min.y - 1) };
+    max = { std::min(size.x - 1, max.x + 1), std::min(size.y - 1, max.y + 1) };
+
+    if (min.x > max.x or min.y > max.y) {
         return;
     }
 
-    particle.material = new_material;
-    particle.color = random_color(particle.material);
+    const int chunk_size = static_cast<int>(multithreading_kernel_size);
+
+    for (int chunk_y = min.y >> chunk_shift; chunk_y <= max.y >> chunk_shift; chunk_y++) {
+        for (int chunk_x = min.x >> chunk_shift; chunk_x <= max.x >> chunk_shift; chunk_x++) {
+            const std::int32_t slot = chunk_table.get_slot({ chunk_x, chunk_y });
+
+            // Chunks without cells of their own are all air, nothing in them can happen
+            if (slot == 0) {
+                continue;
+            }
+
+            const sf::Vector2i chunk_min = { chunk_x * chunk_size, chunk_y * chunk_size };
+            const sf::Vector2i chunk_max = chunk_min + sf::Vector2i(chunk_size - 1, chunk_size - 1);
+
+            Chunk& chunk = chunks[slot];
+
+            chunk.expand_next(
+                { std::max(min.x, chunk_min.x), std::max(min.y, chunk_min.y) },
+                { std::min(max.x, chunk_max.x), std::min(max.y, chunk_max.y) }
+            );
 
-    particle_layers[coordinate_index] = particle;
+            // Checked first so that chunks touched many times per step are only written once
+            if (chunk.changed_version.load(std::memory_order_relaxed) != change_version) {
+                chunk.changed_version.store(change_version, std::memory_order_relaxed);
+            }
+        }
+    }
 }
 
 
-void ParticleSimulation::update_movement(Particle& particle, sf::Vector2i coordinate, int coordinate_index, std::vector<sf::Vector2i>& surroundings) {
-    const static std::vector<sf::Vector2i> offsets = {
-        { -1, -1 }, { 0, -1 }, { 1, -1 },
-        { -1, 0 }, { 0, 0 }, { 1, 0 },
-        { -1, 1}, { 0, 1 }, { 1, 1 }
-    };
+void ParticleSimulation::set_material(int index, MaterialID material) {
+    const MaterialID old_material = cell_materials[index];
 
-    if (particle_layers[coordinate_index].moved) {
+    if (old_material == material) {
         return;
     }
 
-    std::vector<int> valid_moves;
-    std::vector<int> valid_weights;
+    cell_materials[index] = material;
 
-    for (int i = 0; i < 9; i++) {
-        int weight = behaviors[materials[particle.material].behavior].movement_weights[i];
-        if (weight == 0) {
-            continue;
-        }
+    // Relaxed is enough, the counts are only read between steps
+    material_counts[(size_t)old_material].fetch_sub(1, std::memory_order_relaxed);
+    material_counts[(size_t)material].fetch_add(1, std::memory_order_relaxed);
+}
 
-        if (i == 4) { 
-            valid_moves.push_back(i); 
-            valid_weights.push_back(weight); 
-            continue; 
-        }
 
-        int index = get_index(coordinate + offsets[i]);
-        if (index == -1) {
-            continue;
-        }
+CellRandom ParticleSimulation::get_random(sf::Vector2i position, RandomStream stream) const {
+    return CellRandom(seed, tick, position, stream);
+}
 
-        if (particle_layers[index].moved) {
-            continue;
-        }
 
-        bool denser = materials[particle.material].density > materials[particle_layers[index].material].density;
-        if (not denser) {
+void ParticleSimulation::advance_chunks() {
+    PROFILE_SCOPE("advance_chunks");
+
+    awake_tiles.clear();
+
+    for (Chunk& chunk : chunks) {
+        if (chunk.tile.x < 0) {
             continue;
         }
 
-        valid_moves.push_back(i);
-        valid_weights.push_back(behaviors[materials[particle.material].behavior].movement_weights[i]);
+        chunk.advance();
+
+        // Awake chunks may change temperatures by less than the sleep threshold,
+        // which does not mark them dirty, so they count as changed this step
+        if (chunk.is_awake()) {
+            chunk.changed_version.store(change_version, std::memory_order_relaxed);
+            awake_tiles.push_back(chunk.tile);
+        }
     }
 
-    if (valid_moves.empty()) {
-        return;
+    // A particle reaches at most half a chunk past its own, so every chunk next to an
+    // awake one gets cells of its own before the step instead of in the middle of it
+    for (sf::Vector2i tile : awake_tiles) {
+        for (int y = std::max(0, tile.y - 1); y <= std::min(chunk_count.y - 1, tile.y + 1); y++) {
+            for (int x = std::max(0, tile.x - 1); x <= std::min(chunk_count.x - 1, tile.x + 1); x++) {
+                allocate_chunk({ x, y });
+            }
+        }
     }
 
-    std::discrete_distribution<> dist(valid_weights.begin(), valid_weights.end());
+    release_empty_chunks();
 
-    int choice = dist(gen);
-    int move_index = valid_moves[choice];
+    std::sort(awake_tiles.begin(), awake_tiles.end(), [](sf::Vector2i a, sf::Vector2i b) {
+        return a.y != b.y ? a.y > b.y : a.x < b.x;
+    });
+}
 
-    if (move_index == 4) {
-        return; // Don't mark particle as moved when it stayed still
-    }
 
-    swap(coordinate, coordinate + offsets[move_index]);
+/////////////////////////////////////////////
+// Functions for ParticleSimulation::Chunk //
+/////////////////////////////////////////////
+
+bool ParticleSimulation::Chunk::is_awake() const {
+    return dirty_min.x <= dirty_max.x and dirty_min.y <= dirty_max.y;
+}
+
+
+void ParticleSimulation::Chunk::expand_next(sf::Vector2i min, sf::Vector2i max) {
+    auto atomic_min = [](std::atomic<int>& value, int candidate) {
+        int current = value.load(std::memory_order_relaxed);
+        while (candidate < current and not value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+    };
+
+    auto atomic_max = [](std::atomic<int>& value, int candidate) {
+        int current = value.load(std::memory_order_relaxed);
+        while (candidate > current and not value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+    };
+
+    atomic_min(next_min_x, min.x);
+    atomic_min(next_min_y, min.y);
+    atomic_max(next_max_x, max.x);
+    atomic_max(next_max_y, max.y);
+}
+
+
+void ParticleSimulation::Chunk::advance() {
+    dirty_min = { next_min_x.exchange(INT_MAX, std::memory_order_relaxed), next_min_y.exchange(INT_MAX, std::memory_order_relaxed) };
+    dirty_max = { next_max_x.exchange(INT_MIN, std::memory_order_relaxed), next_max_y.exchange(INT_MIN, std::memory_order_relaxed) };
 }
 
 
-void ParticleSimulation::update_particle(sf::Vector2i coordinate) {
-    int coordinate_index = get_index(coordinate);
+template <BehaviorID Behavior>
+void ParticleSimulation::update_kernel(sf::Vector2i coordinate, int coordinate_index) {
+    const MaterialID material = cell_materials[coordinate_index];
 
-    if (particle_layers[coordinate_index].material == MaterialID::Air) {
+    update_material(coordinate, coordinate_index);
+
+    // Nothing in the world reacts with most materials, which a single AND rules out
+    if (material_rules[cell_materials[coordinate_index]].reacts_with & present_materials) {
+        update_reactions(coordinate, coordinate_index);
+    }
+
+    // A cell that just turned into another material may move in ways this kernel is not built for
+    if (cell_materials[coordinate_index] != material) {
+        update_movement<get_kernel_directions(BehaviorID::COUNT)>(coordinate, coordinate_index);
         return;
     }
 
-    Particle particle = particle_layers[coordinate_index];
+    update_movement<get_kernel_directions(Behavior)>(coordinate, coordinate_index);
+}
+
 
-    std::vector<sf::Vector2i> surroundings = get_surroundings(coordinate);
+void ParticleSimulation::update_particle(sf::Vector2i coordinate, int coordinate_index) {
+    const MaterialID material = cell_materials[coordinate_index];
 
-    update_temp(particle, coordinate_index, surroundings);
-    
-    update_material(particle, coordinate_index);
+    if (material == MaterialID::Air) {
+        return;
+    }
 
-    update_movement(particle, coordinate, coordinate_index, surroundings);
+    switch (material_rules[material].kernel) {
+        case BehaviorID::Solid: update_kernel<BehaviorID::Solid>(coordinate, coordinate_index); break;
+        case BehaviorID::Powder: update_kernel<BehaviorID::Powder>(coordinate, coordinate_index); break;
+        case BehaviorID::Liquid: update_kernel<BehaviorID::Liquid>(coordinate, coordinate_index); break;
+        case BehaviorID::Gas: update_kernel<BehaviorID::Gas>(coordinate, coordinate_index); break;
+        default: update_kernel<BehaviorID::COUNT>(coordinate, coordinate_index); break;
+    }
 }
\ No newline at end of file
@@ -5,77 +5,457 @@
 #include <SFML/System/Vector2.hpp>
 
 #include <vector>
+#include <deque>
 #include <string>
+#include <memory>
+#include <atomic>
 #include <unordered_map>
+#include <climits>
+#include <functional>
+#include <random>
+#include <array>
+#include <optional>
 
 #include "particles.hpp"
+#include "grid_renderer.hpp"
+#include "camera.hpp"
+#include "lod_pyramid.hpp"
+#include "visualization.hpp"
+#include "world_snapshot.hpp"
+#include "chunk_table.hpp"
+#include "src/multi-threading/thread_pool.hpp"
 
 
 class ParticleSimulation {
 public:
-	////////////////////////////////////////////////////////////
-	// \brief Initializes an empty simulation                 
-	// \param size the size of the simulation {width, height} 
-	////////////////////////////////////////////////////////////
-    ParticleSimulation(sf::Vector2i size);
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Initializes an empty simulation                                                    
+	// Cells are only stored for chunks that hold something, so a mostly empty world can be huge 
+	// \param size the size of the simulation {width, height}                                    
+	// \param seed All randomness in the simulation is derived from this value                   
+	///////////////////////////////////////////////////////////////////////////////////////////////
+    ParticleSimulation(sf::Vector2i size, std::uint64_t seed = std::random_device{}());
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Restores a simulation from a snapshot, for example one read by load_world    
+	// Every chunk starts awake, so the first step updates the whole world                 
+	// \param snapshot The world to restore, its size, seed, tick and cells are taken over 
+	/////////////////////////////////////////////////////////////////////////////////////////
+	ParticleSimulation(const WorldSnapshot& snapshot);
 
 	////////////////////////////////////////////
 	// \brief Updates the simulation one step 
 	////////////////////////////////////////////
 	void update();
 
+	///////////////////////////////////////////////////////////////////////////////////////
+	// \brief Switches update() between the tiled multi-threaded path and the serial one 
+	// \param enabled If false the whole grid is walked on the calling thread            
+	// \param core_count Number of worker threads to use, 0 keeps the current count      
+	///////////////////////////////////////////////////////////////////////////////////////
+	void set_multithreading(bool enabled, std::size_t core_count = 0);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Binds every worker thread to its own cpu, the thread calling update() is left alone 
+	// Helps on machines with many cores where workers wandering between cpus lose their caches   
+	// \param enabled If false the workers may run on any cpu                                     
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	void set_thread_pinning(bool enabled);
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Sets how often heat is also exchanged between whole chunks, on top of cell to cell     
+	// Cell to cell diffusion needs thousands of steps to carry heat across a large body, the chunk  
+	// pass carries it a chunk per pass. It conserves heat, never overshoots and only reaches cells  
+	// connected to the neighbor through other non air cells                                        
+	// \param interval Steps between chunk passes, 0 leaves only cell to cell diffusion              
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	void set_thermal_coarse_interval(unsigned int interval);
+
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Manipulates values in the simulation                                               
+	// \param brush_size The size of the square of influence                                     
+	// \param position The center of the square of influence in view coordinates, see get_camera 
+	// \param material Every pixel in the square of influence will be set to this material       
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	void brush(int brush_size, sf::Vector2i position, MaterialID material);
+
 	/////////////////////////////////////////////////////////////////////////////////////////
-	// \brief Manipulates values in the simulation                                         
+	// \brief Same as brush, but centered on a cell of the grid instead of a view position 
 	// \param brush_size The size of the square of influence                               
-	// \param position The center of the square of influence                               
+	// \param cell The grid cell {x, y} at the center of the square of influence           
 	// \param material Every pixel in the square of influence will be set to this material 
 	/////////////////////////////////////////////////////////////////////////////////////////
-	void brush(int brush_size, sf::Vector2i position, MaterialID material);
+	void paint(int brush_size, sf::Vector2i cell, MaterialID material);
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// \brief Fills a rectangle of cells, like paint only air is replaced unless erasing 
+	// \param min The top left cell of the rectangle, cells outside the grid are skipped 
+	// \param max The bottom right cell of the rectangle (inclusive)                     
+	// \param material The material to fill with, Air erases                             
+	///////////////////////////////////////////////////////////////////////////////////////
+	void fill_rect(sf::Vector2i min, sf::Vector2i max, MaterialID material);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Fills the cells within radius of center, like paint only air is replaced unless erasing 
+	// \param center The grid cell {x, y} at the center of the circle                                 
+	// \param radius Cells at most this far from center are filled                                    
+	// \param material The material to fill with, Air erases                                          
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void fill_circle(sf::Vector2i center, int radius, MaterialID material);
 
-	/////////////////////////////////////////////////////////////////////////////////////
-	// \brief Draws the current state of the simulation using sfml                     
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Paints every cell a brush moving from one cell to another passes over               
+	// Joins the cells of a stroke painted on two frames, however far the cursor moved in between 
+	// \param from The grid cell the brush starts at                                              
+	// \param to The grid cell the brush ends at                                                  
+	// \param brush_size The size of the square of influence                                      
+	// \param material The material to fill with, Air erases                                      
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	void fill_line(sf::Vector2i from, sf::Vector2i to, int brush_size, MaterialID material);
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Replaces the material of cell and of every cell of that material connected to it 
+	// Air in a large world can reach millions of cells, so the fill stops after max_cells     
+	// \param cell The grid cell {x, y} to start from                                          
+	// \param material The material to fill with, Air erases                                   
+	// \param max_cells The most cells to fill                                                 
+	// \return The number of cells filled                                                      
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	std::size_t flood_fill(sf::Vector2i cell, MaterialID material, std::size_t max_cells = 1 << 22);
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Copies a rectangle of cells into a stamp, which can be pasted anywhere later 
+	// \param min The top left cell of the rectangle, the rectangle is clipped to the grid 
+	// \param max The bottom right cell of the rectangle (inclusive)                       
+	// \param stamp The stamp to fill, its previous contents are reused                    
+	/////////////////////////////////////////////////////////////////////////////////////////
+	void copy_stamp(sf::Vector2i min, sf::Vector2i max, CellStamp& stamp) const;
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// \brief Writes the cells of a stamp into the grid, overwriting what was there 
+	// \param stamp A stamp filled by copy_stamp                                    
+	// \param position The grid cell the top left cell of the stamp lands on        
+	// \param skip_air If true the air cells of the stamp leave the grid unchanged  
+	//////////////////////////////////////////////////////////////////////////////////
+	void paste_stamp(const CellStamp& stamp, sf::Vector2i position, bool skip_air = true);
+
+	////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Draws the part of the simulation the camera sees using sfml                     
+	// Only the visible cells are read, so the cost depends on the view and not on the world. 
+	// Zoomed out past one pixel per cell a downsampled copy is read instead, see LodPyramid  
+	// \param target The sfml target to draw the image to                                     
+	// \param mode Which cell field is shown, see DisplayMode                                 
+	////////////////////////////////////////////////////////////////////////////////////////////
+	void draw_sfml(sf::RenderTarget& target, DisplayMode mode = DisplayMode::Standard);
+
+	///////////////////////////////////////////////////////////////////////////////////
+	// \brief Draws a snapshot of this simulation, the simulation itself is not read 
+	// Safe to call while another thread is updating the simulation                  
 	// \param target The sfml target to draw the image to                            
-	// \param use_temp_coloring If true the colors will be based on the particles temp 
-	/////////////////////////////////////////////////////////////////////////////////////
-	void draw_sfml(sf::RenderTarget& target, bool use_temp_coloring = false);
+	// \param snapshot A snapshot filled by capture                                  
+	// \param mode Which cell field is shown, see DisplayMode                        
+	///////////////////////////////////////////////////////////////////////////////////
+	void draw_sfml(sf::RenderTarget& target, const WorldSnapshot& snapshot, DisplayMode mode = DisplayMode::Standard);
 
+	////////////////////////////////////////////////////////////////////////////////
+	// \brief Outlines the cells a brush at mouse_pos would paint                 
+	// \param window The sfml window to draw the outline to                       
+	// \param brush_size The size of the square of influence                      
+	// \param mouse_pos The center of the square of influence in view coordinates 
+	////////////////////////////////////////////////////////////////////////////////
 	void draw_brush_outline_sfml(sf::RenderWindow& window, int brush_size, sf::Vector2i mouse_pos);
 
 	////////////////////////////////////////////////////////////////////////////////////////////////
-	// \brief Returns information about the particle at position                                 
-	// \param position The position (relative to the window) of the particle you want the info of
+	// \brief Returns information about the particle at position                                
+	// \param position The position (in view coordinates) of the particle you want the info of   
 	////////////////////////////////////////////////////////////////////////////////////////////////
 	ParticleInformation get_particle_information(sf::Vector2i position);
 
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Same as get_particle_information, but reads the cell from a snapshot                
+	// \param position The position (in view coordinates) of the particle you want the info of    
+	// \param snapshot A snapshot filled by capture                                               
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	ParticleInformation get_particle_information(sf::Vector2i position, const WorldSnapshot& snapshot) const;
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the grid cell under a view position, nothing when it is outside the grid               
+	// Only reads the size and the camera, so it is safe to call while another thread updates the simulation 
+	// \param position The position in view coordinates                                                      
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::optional<sf::Vector2i> get_cell_at(sf::Vector2i position) const;
+
 	///////////////////////////////////////////////////////////////////////////////////////////////////////
 	// \brief Returns the number of non air particles in the simulation
 	///////////////////////////////////////////////////////////////////////////////////////////////////////
-	std::size_t get_particle_count();
+	std::size_t get_particle_count() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the number of cells of one material, kept up to date as cells change 
+	/////////////////////////////////////////////////////////////////////////////////////////
+	std::size_t get_material_count(MaterialID material) const;
+
+	/////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the number of cells of every material, indexed by MaterialID 
+	/////////////////////////////////////////////////////////////////////////////////
+	std::array<std::size_t, (size_t)MaterialID::COUNT> get_material_histogram() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the number of non air cells of every behavior, indexed by BehaviorID 
+	/////////////////////////////////////////////////////////////////////////////////////////
+	std::array<std::size_t, (size_t)BehaviorID::COUNT> get_behavior_histogram() const;
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the number of chunks that will be updated on the next step                     
+	// Chunks where nothing moved and no temperature changed are skipped until a neighbor wakes them 
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	std::size_t get_active_chunk_count() const;
+
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the number of chunks with cells of their own                               
+	// Chunks get them when something is painted or could move into them and lose them once they 
+	// are back to air at ambient temperature, the rest of the world takes no memory             
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	std::size_t get_stored_chunk_count() const;
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the seed the simulation was created with                           
+	// The same seed and the same edits on the same ticks always produce the same world, 
+	// as long as multithreading stays either enabled or disabled for the whole run      
+	///////////////////////////////////////////////////////////////////////////////////////
+	std::uint64_t get_seed() const;
+
+	///////////////////////////////////////////////////
+	// \brief Returns the number of steps run so far 
+	///////////////////////////////////////////////////
+	std::uint32_t get_tick() const;
+
+	sf::Vector2i get_size() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the camera that drawing, brushes and particle information go through 
+	// The simulation never touches it, so it belongs to the thread that draws             
+	/////////////////////////////////////////////////////////////////////////////////////////
+	Camera& get_camera();
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns whether update() takes the tiled path, see set_multithreading 
+	//////////////////////////////////////////////////////////////////////////////////
+	bool is_multithreading_enabled() const;
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns a hash of every cell and the tick                                             
+	// Two simulations with the same checksum are in the same state, however their cells are stored 
+	// Walks the whole world, so it is meant to be taken every few ticks rather than every tick     
+	//////////////////////////////////////////////////////////////////////////////////////////////////
+	std::uint64_t get_checksum() const;
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns a read only view of the cell planes, valid until the next step or edit 
+	///////////////////////////////////////////////////////////////////////////////////////////
+	CellPlanes get_cell_planes() const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Copies the current state of the simulation into a snapshot                           
+	// Only chunks that changed since the snapshot was last filled from this simulation are copied 
+	// \param snapshot The snapshot to fill, its previous contents are reused                      
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	void capture(WorldSnapshot& snapshot) const;
 
 private:
+	// How a particle moved on its last step, it travels along when the particle is displaced
+	struct Motion {
+		// Cells travelled per step, up to max_speed
+		std::uint8_t speed = 1;
+
+		// -1 or 1 while the particle slides left or right unhindered, 0 otherwise
+		std::int8_t heading = 0;
+	};
+
+	struct Chunk {
+		// Cells to update this step in world coordinates (inclusive), empty when min > max
+		sf::Vector2i dirty_min = { 0, 0 };
+		sf::Vector2i dirty_max = { -1, -1 };
+
+		// Cells touched during this step, they become the dirty rect of the next step
+		std::atomic<int> next_min_x = INT_MAX;
+		std::atomic<int> next_min_y = INT_MAX;
+		std::atomic<int> next_max_x = INT_MIN;
+		std::atomic<int> next_max_y = INT_MIN;
+
+		// Change version of the last step or edit that touched a cell of this chunk
+		std::atomic<std::uint64_t> changed_version = 0;
+
+		// The chunk whose cells this slot holds, {-1, -1} while the slot is free
+		sf::Vector2i tile = { -1, -1 };
+
+		// Whether every cell was air at ambient temperature when the chunk was last
+		// looked at, which was when changed_version was checked_version
+		bool empty = false;
+		std::uint64_t checked_version = 0;
+
+		// Filled by the coarse thermal pass of step coarse_tick, see update_coarse_thermal.
+		// Per border (right, down, left, up) the number of non air cells connected to the
+		// ones touching the neighbor across it, and their average temperature. Contacts
+		// count the touching non air cell pairs across the right and bottom border
+		std::uint32_t coarse_tick = 0;
+		std::array<float, 4> coarse_solid = {};
+		std::array<float, 4> coarse_average = {};
+		float coarse_contact_right = 0.f;
+		float coarse_contact_down = 0.f;
+
+		bool is_awake() const;
+
+		void expand_next(sf::Vector2i min, sf::Vector2i max);
+
+		void advance();
+	};
+
 	int get_index(sf::Vector2i position) const;
 
+	int get_neighbor_index(sf::Vector2i coordinate, int coordinate_index, sf::Vector2i offset) const;
+
 	sf::Vector2i get_coordinate(int index) const;
 
-	std::vector<sf::Vector2i> get_surroundings(sf::Vector2i pos) const;
+	void swap(int index_a, int index_b);
+
+	// Writes material into the cells min_x to max_x of row y, which must be inside the grid.
+	// Only air is replaced unless overwrite is set or material is air
+	void fill_span(int y, int min_x, int max_x, MaterialID material, bool overwrite);
+
+	void update_material(sf::Vector2i coordinate, int coordinate_index);
+
+	template <std::uint16_t Directions>
+	void update_movement(sf::Vector2i coordinate, int coordinate_index);
+
+	void update_reactions(sf::Vector2i coordinate, int coordinate_index);
+
+	template <BehaviorID Behavior>
+	void update_kernel(sf::Vector2i coordinate, int coordinate_index);
+
+	void update_particle(sf::Vector2i coordinate, int coordinate_index);
+
+	void draw_cells(sf::RenderTarget& target, const CellPlanes& cells, DisplayMode mode, bool parallel);
+
+	void draw_texels(sf::RenderTarget& target, const CellPlanes& cells, DisplayMode mode, sf::IntRect visible, bool parallel);
+
+	void fill_chunk_stamps(std::vector<ChunkStamp>& stamps) const;
+
+	void update_serial();
+
+	void update_parallel();
+
+	void update_tile(sf::Vector2i tile);
+
+	void update_thermal();
+
+	void diffuse_tile(sf::Vector2i tile);
+
+	void update_coarse_thermal();
+
+	void gather_coarse_tile(sf::Vector2i tile);
+
+	float count_coarse_contact(sf::Vector2i tile, sf::Vector2i offset) const;
+
+	void reach_coarse_borders(sf::Vector2i tile, std::vector<std::uint8_t>& reach) const;
+
+	void relax_coarse_tile(sf::Vector2i tile);
+
+	template <typename Task>
+	void run_on_tiles(const std::vector<sf::Vector2i>& tiles, Task&& task);
+
+	void create_thread_pool();
 
-	void swap(sf::Vector2i a, sf::Vector2i b);
+	Chunk& get_chunk(sf::Vector2i tile);
 
-	void update_temp(Particle& particle, int coordinate_index, std::vector<sf::Vector2i>& surroundings);
+	std::int32_t allocate_chunk(sf::Vector2i tile);
 
-	void update_material(Particle& particle, int coordinate_index);
+	void allocate_chunks(sf::Vector2i min, sf::Vector2i max);
 
-	void update_movement(Particle& particle, sf::Vector2i coordinate, int coordinate_index, std::vector<sf::Vector2i>& surroundings);
+	void release_chunk(std::int32_t slot);
 
-	void update_particle(sf::Vector2i coordinate);
+	void release_empty_chunks();
+
+	bool is_chunk_empty(std::int32_t slot) const;
+
+	bool has_awake_neighbor(sf::Vector2i tile);
+
+	void mark_dirty(sf::Vector2i position);
+
+	void mark_dirty(sf::Vector2i min, sf::Vector2i max);
+
+	void advance_chunks();
+
+	void set_material(int index, MaterialID material);
+
+	CellRandom get_random(sf::Vector2i position, RandomStream stream) const;
 
 	sf::Vector2i size;
 
-	std::vector<Particle> particle_layers;
+	std::uint64_t seed;
+
+	// One plane per cell field, indexed by get_index so each chunk is contiguous.
+	// Planes hold one block of cells per slot of chunk_table and only grow between steps
+	std::vector<MaterialID> cell_materials;
+	std::vector<float> cell_temps;
+	std::vector<float> cell_temps_next;
+
+	// Which shade of its material a cell is drawn in, see color_palettes
+	std::vector<std::uint8_t> cell_shades;
+
+	// Not part of snapshots, restored particles start at rest
+	std::vector<Motion> cell_motions;
+
+	std::array<std::atomic<std::int64_t>, (size_t)MaterialID::COUNT> material_counts;
+
+	// Bit m is set when some cell was material m at the start of this step
+	std::uint32_t present_materials = 0;
+
+	// A cell has moved this step when its stamp equals tick
+	std::vector<std::uint32_t> cell_moved_tick;
+	std::uint32_t tick = 0;
+
+	// Bumped by every step and every edit, chunks are stamped with it when they change
+	std::uint64_t change_version = 0;
+
+	int chunk_shift = 0;
+	sf::Vector2i chunk_count;
+
+	ChunkTable chunk_table;
+
+	// Indexed by slot, slot 0 belongs to every chunk without cells of its own and never wakes up
+	std::deque<Chunk> chunks;
+	std::vector<std::int32_t> free_slots;
+
+	// Bumped whenever a chunk gets or loses its slot
+	std::uint64_t table_version = 0;
+
+	// Chunks to update this step, bottom row first and left to right within a row
+	std::vector<sf::Vector2i> awake_tiles;
+
+	float temp_sleep_threshold = 0.05f;
+
+	// Every this many steps heat also moves between whole chunks, 0 turns it off
+	unsigned int thermal_coarse_interval = 4;
+
+	// Chunks in the current coarse thermal pass, the awake ones and their neighbors
+	std::vector<sf::Vector2i> coarse_tiles;
+
+	bool multithreading_enabled = true;
+	std::unique_ptr<ThreadPool> thread_pool;
 
 	std::size_t multithreading_core_count = 4;
-	unsigned int multithreading_kernel_size = 8;
+	bool multithreading_pin_threads = false;
+	unsigned int multithreading_kernel_size = 32;
+
+	// Half a tile, see the constructor
+	std::uint8_t max_speed = 1;
+
+	GridRenderer renderer;
+
+	// Only kept up to date while the camera is zoomed out past one pixel per cell
+	LodPyramid lod_pyramid;
+	std::vector<ChunkStamp> draw_stamps;
 
-	std::uint8_t cell_px = 8;
-	std::uint8_t gap = 1;
+	Camera camera;
 };
\ No newline at end of file
@@ -8,9 +8,10 @@
 #include <algorithm>
 #include <array>
 #include <vector>
+#include <limits>
+#include <type_traits>
 
-
-inline std::mt19937 gen(std::random_device{}());
+#include "random.hpp"
 
 
 enum class MaterialID : uint8_t {
@@ -36,17 +37,20 @@ enum class BehaviorID : uint8_t {
 };
 
 
+// Temperature of a fresh cell, empty chunks are air at this temperature
+inline constexpr float ambient_temp = 20.f;
+
+
 struct Behavior {
     std::string identifier = "none";
-    std::vector<uint8_t> movement_weights;
+    std::array<uint8_t, 9> movement_weights = {};
 };
 
 
+// How a material behaves, the simulation reads it through material_rules
 struct Material {
     BehaviorID behavior;
 
-	std::string identifier = "none";
-
     float density;
 
     float state_change_high_temp;
@@ -54,6 +58,12 @@ struct Material {
 
 	float state_change_low_temp;
     MaterialID state_change_low_new;
+};
+
+
+// How a material is named and colored, only the ui, files and new cells read it
+struct MaterialInfo {
+	std::string identifier = "none";
 
 	sf::Color base_color;
 	int color_offset;
@@ -70,8 +80,79 @@ struct Table {
 };
 
 
+// Everything a step reads about a material, derived from the materials and behaviors
+// tables by build_material_rules. Rows are half a cache line and the table is aligned
+// to a whole one, so no lookup ever touches two lines
+struct alignas(32) MaterialRule {
+    // Bit m is set when this material is denser than material m
+    uint32_t displaces = 0;
+
+    // Bit m is set when reactions[this material][m] can happen
+    uint32_t reacts_with = 0;
+
+    // Above high_temp the cell turns into high_new and below low_temp into low_new,
+    // the temperatures are infinite for changes that would keep the material
+    float high_temp = std::numeric_limits<float>::infinity();
+    float low_temp = -std::numeric_limits<float>::infinity();
+    MaterialID high_new = MaterialID::Air;
+    MaterialID low_new = MaterialID::Air;
+
+    // Bit i is set when weights[i] is not 0
+    uint16_t directions = 0;
+    std::array<uint8_t, 9> weights = {};
+
+    // The behavior whose update kernel handles these weights, COUNT for the generic one
+    BehaviorID kernel = BehaviorID::COUNT;
+
+    bool can_displace(MaterialID other) const {
+        return (displaces >> (size_t)other) & 1;
+    }
+
+    bool can_react(MaterialID other) const {
+        return (reacts_with >> (size_t)other) & 1;
+    }
+};
+
+static_assert(sizeof(MaterialRule) == 32, "MaterialRule rows are packed two to a cache line");
+static_assert(std::is_trivially_copyable_v<MaterialRule>, "MaterialRule is plain data");
+static_assert((size_t)MaterialID::COUNT <= 32, "MaterialRule::displaces holds one bit per material");
+
+
+// What happens when two materials touch, looked up as reactions[material][neighbor]
+struct Reaction {
+    // Chance that a touching pair reacts when one of its cells is updated, 0 for pairs that don't react
+    float probability = 0.f;
+
+    MaterialID product = MaterialID::Air;
+    MaterialID neighbor_product = MaterialID::Air;
+
+    // Both cells end up at their average temperature plus heat
+    float heat = 0.f;
+};
+
+
 inline Table<Behavior, BehaviorID> behaviors;
 inline Table<Material, MaterialID> materials;
+inline Table<MaterialInfo, MaterialID> material_info;
+alignas(64) inline Table<MaterialRule, MaterialID> material_rules;
+inline Table<Table<Reaction, MaterialID>, MaterialID> reactions;
+
+
+// Every material has this many shades around its base color, a cell stores which one it shows
+inline constexpr size_t palette_size = 256;
+
+// The shades of every material, indexed by (material << 8) | shade, see build_color_palettes
+inline std::array<sf::Color, (size_t)MaterialID::COUNT * palette_size> color_palettes;
+
+
+inline sf::Color get_cell_color(MaterialID material, std::uint8_t shade) {
+    return color_palettes[((size_t)material << 8) | shade];
+}
+
+
+inline std::uint8_t random_shade(CellRandom& random) {
+    return static_cast<std::uint8_t>(random() >> 24);
+}
 
 
 inline void register_material_behaviors() {
@@ -113,127 +194,256 @@ inline void register_material_behaviors() {
 }
 
 
+// Directions the update kernel of each behavior is compiled for, bit i stands for
+// movement_weights[i] so the bottom row comes first. Materials with weights outside
+// of them use the generic kernel
+constexpr uint16_t get_kernel_directions(BehaviorID behavior) {
+    switch (behavior) {
+        case BehaviorID::Solid: return 0b000'010'000;
+        case BehaviorID::Powder: return 0b111'010'000;
+        case BehaviorID::Liquid: return 0b111'111'000;
+        case BehaviorID::Gas: return 0b000'111'111;
+        default: return 0b111'111'111;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Rebuilds material_rules from the behaviors, materials and reactions tables              
+// Called by register_materials and register_reactions, call it again after changing any of them  
+////////////////////////////////////////////////////////////////////////////////////////////////////
+inline void build_material_rules() {
+    for (size_t i = 0; i < (size_t)MaterialID::COUNT; i++) {
+        const Material& material = materials.data[i];
+        MaterialRule& rule = material_rules.data[i];
+
+        rule = MaterialRule();
+        rule.weights = behaviors[material.behavior].movement_weights;
+
+        if (material.state_change_high_new != static_cast<MaterialID>(i)) {
+            rule.high_temp = material.state_change_high_temp;
+            rule.high_new = material.state_change_high_new;
+        }
+
+        if (material.state_change_low_new != static_cast<MaterialID>(i)) {
+            rule.low_temp = material.state_change_low_temp;
+            rule.low_new = material.state_change_low_new;
+        }
+
+        for (size_t direction = 0; direction < rule.weights.size(); direction++) {
+            if (rule.weights[direction] != 0) {
+                rule.directions |= 1 << direction;
+            }
+        }
+
+        if ((rule.directions & ~get_kernel_directions(material.behavior)) == 0) {
+            rule.kernel = material.behavior;
+        }
+
+        for (size_t other = 0; other < (size_t)MaterialID::COUNT; other++) {
+            if (material.density > materials.data[other].density) {
+                rule.displaces |= 1u << other;
+            }
+
+            if (reactions.data[i].data[other].probability > 0.f) {
+                rule.reacts_with |= 1u << other;
+            }
+        }
+    }
+}
+
+
+inline sf::Color random_color(MaterialID material, CellRandom& random) {
+    sf::Color color = material_info[material].base_color;
+    const int offset = material_info[material].color_offset;
+    const std::uint32_t range = static_cast<std::uint32_t>(2 * offset + 1);
+
+    int r = std::clamp(static_cast<int>(color.r) + static_cast<int>(random.next_below(range)) - offset, 0, 255);
+    int g = std::clamp(static_cast<int>(color.g) + static_cast<int>(random.next_below(range)) - offset, 0, 255);
+    int b = std::clamp(static_cast<int>(color.b) + static_cast<int>(random.next_below(range)) - offset, 0, 255);
+    int a = color.a;
+
+   return sf::Color(r, g, b, a);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Rebuilds color_palettes from the base colors and offsets of material_info          
+// Called by register_materials. Cells only store which shade they show, so calling it again 
+// after changing a color recolors every cell of that material at once                       
+///////////////////////////////////////////////////////////////////////////////////////////////
+inline void build_color_palettes() {
+    for (size_t i = 0; i < (size_t)MaterialID::COUNT; i++) {
+        const MaterialID material = static_cast<MaterialID>(i);
+
+        // The same shades every run, so saved worlds look the same when loaded again
+        for (size_t shade = 0; shade < palette_size; shade++) {
+            CellRandom random(0, 0, { static_cast<int>(shade), static_cast<int>(i) }, RandomStream::Brush);
+            color_palettes[(i << 8) | shade] = random_color(material, random);
+        }
+    }
+}
+
+
 inline void register_materials() {
     materials[MaterialID::Air] = {
         .behavior = BehaviorID::Solid,
-        .identifier = "air",
         .density = 0.f,
         .state_change_high_temp = 0,
         .state_change_high_new = MaterialID::Air,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Air,
-        .base_color = sf::Color(0, 0, 0),
-        .color_offset = 0,
     };
 
     materials[MaterialID::Rock] = {
         .behavior = BehaviorID::Solid,
-        .identifier = "rock",
         .density = 4.0f,
         .state_change_high_temp = 700,
         .state_change_high_new = MaterialID::Lava,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Rock,
-        .base_color = sf::Color(128, 128, 128),
-        .color_offset = 5,
     };
 
     materials[MaterialID::Lava] = {
         .behavior = BehaviorID::Liquid,
-        .identifier = "lava",
         .density = 0.3f,
         .state_change_high_temp = 0,
         .state_change_high_new = MaterialID::Lava,
         .state_change_low_temp = 699,
         .state_change_low_new = MaterialID::Rock,
-        .base_color = sf::Color(255, 115, 0),
-        .color_offset = 25,
     };
 
     materials[MaterialID::Sand] = {
         .behavior = BehaviorID::Powder,
-        .identifier = "powder",
         .density = 1.1f,
         .state_change_high_temp = 1700,
         .state_change_high_new = MaterialID::MoltenGlass,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Sand,
-        .base_color = sf::Color(255, 255, 0),
-        .color_offset = 25,
     };
 
     materials[MaterialID::MoltenGlass] = {
         .behavior = BehaviorID::Liquid,
-        .identifier = "liquid",
         .density = 0.2f,
         .state_change_high_temp = 0,
         .state_change_high_new = MaterialID::MoltenGlass,
         .state_change_low_temp = 1499,
         .state_change_low_new = MaterialID::Glass,
-        .base_color = sf::Color(255, 188, 79),
-        .color_offset = 20,
     };
 
     materials[MaterialID::Glass] = {
         .behavior = BehaviorID::Solid,
-        .identifier = "glass",
         .density = 4.0f,
         .state_change_high_temp = 1500,
         .state_change_high_new = MaterialID::MoltenGlass,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Glass,
-        .base_color = sf::Color(207, 255, 245),
-        .color_offset = 5,
     };
 
     materials[MaterialID::Water] = {
         .behavior = BehaviorID::Liquid,
-        .identifier = "water",
         .density = 0.1f,
         .state_change_high_temp = 100,
         .state_change_high_new = MaterialID::Steam,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Ice,
-        .base_color = sf::Color(0,128,255),
-        .color_offset = 15,
     };
 
     materials[MaterialID::Ice] = {
         .behavior = BehaviorID::Solid,
-        .identifier = "ice",
         .density = 4.0f,
         .state_change_high_temp = 1,
         .state_change_high_new = MaterialID::Water,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Ice,
-        .base_color = sf::Color(131, 206, 255),
-        .color_offset = 15,
     };
-    
+
     materials[MaterialID::Steam] = {
         .behavior = BehaviorID::Gas,
-        .identifier = "steam",
         .density = 0.01f,
         .state_change_high_temp = 0,
         .state_change_high_new = MaterialID::Steam,
         .state_change_low_temp = 0,
         .state_change_low_new = MaterialID::Water,
+    };
+
+    material_info[MaterialID::Air] = {
+        .identifier = "air",
+        .base_color = sf::Color(0, 0, 0),
+        .color_offset = 0,
+    };
+
+    material_info[MaterialID::Rock] = {
+        .identifier = "rock",
+        .base_color = sf::Color(128, 128, 128),
+        .color_offset = 5,
+    };
+
+    material_info[MaterialID::Lava] = {
+        .identifier = "lava",
+        .base_color = sf::Color(255, 115, 0),
+        .color_offset = 25,
+    };
+
+    material_info[MaterialID::Sand] = {
+        .identifier = "powder",
+        .base_color = sf::Color(255, 255, 0),
+        .color_offset = 25,
+    };
+
+    material_info[MaterialID::MoltenGlass] = {
+        .identifier = "liquid",
+        .base_color = sf::Color(255, 188, 79),
+        .color_offset = 20,
+    };
+
+    material_info[MaterialID::Glass] = {
+        .identifier = "glass",
+        .base_color = sf::Color(207, 255, 245),
+        .color_offset = 5,
+    };
+
+    material_info[MaterialID::Water] = {
+        .identifier = "water",
+        .base_color = sf::Color(0,128,255),
+        .color_offset = 15,
+    };
+
+    material_info[MaterialID::Ice] = {
+        .identifier = "ice",
+        .base_color = sf::Color(131, 206, 255),
+        .color_offset = 15,
+    };
+
+    material_info[MaterialID::Steam] = {
+        .identifier = "steam",
         .base_color = sf::Color(200, 200, 200),
         .color_offset = 5,
     };
+
+    build_material_rules();
+    build_color_palettes();
 }
 
 
-inline sf::Color random_color(MaterialID material) {
-    sf::Color color = materials[material].base_color;
-    std::uniform_int_distribution<int> color_dist(-materials[material].color_offset, materials[material].color_offset);
+////////////////////////////////////////////////////////////////////////
+// \brief Makes material and neighbor react with each other           
+// Both orders are registered, so either cell can start the reaction  
+////////////////////////////////////////////////////////////////////////
+inline void add_reaction(MaterialID material, MaterialID neighbor, float probability, MaterialID product, MaterialID neighbor_product, float heat) {
+    reactions[material][neighbor] = { probability, product, neighbor_product, heat };
+    reactions[neighbor][material] = { probability, neighbor_product, product, heat };
+}
 
-    int r = std::clamp(static_cast<int>(color.r) + color_dist(gen), 0, 255);
-    int g = std::clamp(static_cast<int>(color.g) + color_dist(gen), 0, 255);
-    int b = std::clamp(static_cast<int>(color.b) + color_dist(gen), 0, 255);
-    int a = color.a;
 
-   return sf::Color(r, g, b, a);
+inline void register_reactions() {
+    // Water quenches lava into rock and boils off on the spot
+    add_reaction(MaterialID::Lava, MaterialID::Water, 0.5f, MaterialID::Rock, MaterialID::Steam, 0.f);
+
+    // Sand melts into glass where it sinks through lava, the heat keeps both molten for a while
+    add_reaction(MaterialID::Sand, MaterialID::Lava, 0.05f, MaterialID::MoltenGlass, MaterialID::Lava, 1000.f);
+
+    build_material_rules();
 }
 
 
@@ -243,12 +453,4 @@ public:
     std::string material_name = "";
     std::string behavior_name = "";
     float temp = 0;
-};
-
-
-struct Particle {
-	MaterialID material;
-	float temp;
-	sf::Color color;
-    bool moved = false;
 };
\ No newline at end of file
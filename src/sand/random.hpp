@@ -0,0 +1,71 @@
+﻿#pragma once
+
+#include <SFML/System/Vector2.hpp>
+
+#include <cstdint>
+
+
+enum class RandomStream : std::uint32_t {
+    Brush,
+    Material,
+    Movement,
+    Reaction,
+};
+
+
+inline std::uint64_t mix_bits(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Counter based random numbers for one cell on one tick                                 
+// Every draw is a pure function of the world seed, the tick, the cell position and the stream, 
+// so parallel workers never share any state and the same seed always rebuilds the same world.  
+// Satisfies UniformRandomBitGenerator so it can be handed to the <random> distributions        
+//////////////////////////////////////////////////////////////////////////////////////////////////
+class CellRandom {
+public:
+    using result_type = std::uint32_t;
+
+    CellRandom(std::uint64_t seed, std::uint32_t tick, sf::Vector2i position, RandomStream stream) {
+        const std::uint64_t tick_stream = (static_cast<std::uint64_t>(tick) << 32) | static_cast<std::uint32_t>(stream);
+        const std::uint64_t cell = (static_cast<std::uint64_t>(static_cast<std::uint32_t>(position.x)) << 32) | static_cast<std::uint32_t>(position.y);
+
+        key = mix_bits(seed + 0x9e3779b97f4a7c15ULL);
+        key = mix_bits(key ^ tick_stream);
+        key = mix_bits(key ^ cell);
+    }
+
+    result_type operator()() {
+        counter++;
+        return static_cast<result_type>(mix_bits(key + counter * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // \brief Returns a uniform value in [0, bound) from one draw 
+    ////////////////////////////////////////////////////////////////
+    std::uint32_t next_below(std::uint32_t bound) {
+        return static_cast<std::uint32_t>((static_cast<std::uint64_t>((*this)()) * bound) >> 32);
+    }
+
+    /////////////////////////////////////////////////////////////
+    // \brief Returns a uniform value in [0, 1) from one draw  
+    /////////////////////////////////////////////////////////////
+    float next_float() {
+        return static_cast<float>((*this)() >> 8) * 0x1p-24f;
+    }
+
+    static constexpr result_type min() { return 0; }
+
+    static constexpr result_type max() { return UINT32_MAX; }
+
+private:
+    std::uint64_t key;
+    std::uint64_t counter = 0;
+};
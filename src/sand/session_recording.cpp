@@ -0,0 +1,305 @@
+﻿#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "session_recording.hpp"
+#include "world_file.hpp"
+
+
+// Recording files are plain text:
+//   sand-recording <version>
+//   materials <material table hash>
+//   size <width> <height>
+//   seed <seed>
+//   multithreading <0 or 1>
+//   edit <tick> <time_ms> paint <brush_size> <x> <y> <material id>
+//   edit <tick> <time_ms> line <brush_size> <from x> <from y> <x> <y> <material id>
+//   edit <tick> <time_ms> pause | resume | step
+//   checksum <tick> <value>
+//   end <tick> <value>
+
+static const char* command_names[] = { "paint", "pause", "resume", "step", "line" };
+
+// Bumped whenever the checksum of the same world changes. Version 2 hashes the shade
+// of a cell instead of its color
+static const int recording_version = 2;
+
+
+////////////////////////////////////
+// Functions for SessionRecording //
+////////////////////////////////////
+
+bool SessionRecording::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::trunc);
+
+    if (not file) {
+        return false;
+    }
+
+    file << "sand-recording " << recording_version << "\n"
+        << "materials " << std::hex << get_material_table_hash() << std::dec << "\n"
+        << "size " << size.x << " " << size.y << "\n"
+        << "seed " << seed << "\n"
+        << "multithreading " << multithreading << "\n";
+
+    std::size_t checksum = 0;
+
+    // Checksums go between the edits of neighboring ticks so the file reads in order
+    for (const Edit& edit : edits) {
+        while (checksum < checksums.size() and checksums[checksum].tick <= edit.tick) {
+            file << "checksum " << checksums[checksum].tick << " " << std::hex << checksums[checksum].value << std::dec << "\n";
+            checksum++;
+        }
+
+        const SimulationCommand& command = edit.command;
+        file << "edit " << edit.tick << " " << edit.time_ms << " " << command_names[(size_t)command.type];
+
+        if (command.type == SimulationCommand::Type::Paint) {
+            file << " " << command.brush_size << " " << command.cell.x << " " << command.cell.y << " " << (int)command.material;
+        }
+        else if (command.type == SimulationCommand::Type::Line) {
+            file << " " << command.brush_size << " " << command.from.x << " " << command.from.y << " " << command.cell.x << " " << command.cell.y << " " << (int)command.material;
+        }
+
+        file << "\n";
+    }
+
+    for (; checksum < checksums.size(); checksum++) {
+        file << "checksum " << checksums[checksum].tick << " " << std::hex << checksums[checksum].value << std::dec << "\n";
+    }
+
+    file << "end " << end_tick << " " << std::hex << end_checksum << std::dec << "\n";
+
+    return static_cast<bool>(file);
+}
+
+
+bool SessionRecording::load(const std::string& path, std::string* error) {
+    auto fail = [error](const std::string& message) {
+        if (error) {
+            *error = message;
+        }
+        return false;
+    };
+
+    std::ifstream file(path);
+    std::string line;
+
+    if (not file) {
+        return fail("the file could not be opened");
+    }
+
+    std::string magic;
+    int version = 0;
+
+    if (not std::getline(file, line) or not (std::istringstream(line) >> magic >> version) or magic != "sand-recording") {
+        return fail("not a sand recording");
+    }
+    if (version < recording_version) {
+        return fail("recorded by an older version (" + std::to_string(version) + ") whose checksums can no longer match, record it again");
+    }
+    if (version > recording_version) {
+        return fail("recorded by a newer version (" + std::to_string(version) + ")");
+    }
+
+    *this = SessionRecording();
+    bool ended = false;
+
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::string key;
+        stream >> key;
+
+        if (key == "materials") {
+            std::uint64_t hash;
+            if (not (stream >> std::hex >> hash) or hash != get_material_table_hash()) {
+                return fail("recorded with another material table");
+            }
+        }
+        else if (key == "size") {
+            stream >> size.x >> size.y;
+        }
+        else if (key == "seed") {
+            stream >> seed;
+        }
+        else if (key == "multithreading") {
+            stream >> multithreading;
+        }
+        else if (key == "edit") {
+            Edit edit;
+            std::string name;
+            stream >> edit.tick >> edit.time_ms >> name;
+
+            const auto type = std::find(std::begin(command_names), std::end(command_names), name);
+            if (type == std::end(command_names)) {
+                return fail("malformed line: " + line);
+            }
+
+            edit.command.type = static_cast<SimulationCommand::Type>(type - std::begin(command_names));
+
+            if (edit.command.type == SimulationCommand::Type::Paint or edit.command.type == SimulationCommand::Type::Line) {
+                int material;
+                stream >> edit.command.brush_size;
+
+                if (edit.command.type == SimulationCommand::Type::Line) {
+                    stream >> edit.command.from.x >> edit.command.from.y;
+                }
+
+                stream >> edit.command.cell.x >> edit.command.cell.y >> material;
+
+                if (material < 0 or material >= (int)MaterialID::COUNT) {
+                    return fail("malformed line: " + line);
+                }
+                edit.command.material = static_cast<MaterialID>(material);
+            }
+
+            edits.push_back(edit);
+        }
+        else if (key == "checksum") {
+            Checksum checksum;
+            stream >> checksum.tick >> std::hex >> checksum.value;
+            checksums.push_back(checksum);
+        }
+        else if (key == "end") {
+            stream >> end_tick >> std::hex >> end_checksum;
+            ended = true;
+        }
+        else if (not key.empty()) {
+            return fail("malformed line: " + line);
+        }
+
+        if (stream.fail()) {
+            return fail("malformed line: " + line);
+        }
+    }
+
+    if (not ended or size.x <= 0 or size.y <= 0) {
+        return fail("the recording is incomplete");
+    }
+
+    return true;
+}
+
+
+std::unique_ptr<ParticleSimulation> SessionRecording::create_simulation() const {
+    std::unique_ptr<ParticleSimulation> simulation = std::make_unique<ParticleSimulation>(size, seed);
+    simulation->set_multithreading(multithreading);
+
+    return simulation;
+}
+
+
+///////////////////////////////////
+// Functions for SessionRecorder //
+///////////////////////////////////
+
+SessionRecorder::SessionRecorder(const ParticleSimulation& simulation, std::uint32_t checksum_interval)
+    : checksum_interval(checksum_interval), start(std::chrono::steady_clock::now()) {
+    recording.size = simulation.get_size();
+    recording.seed = simulation.get_seed();
+    recording.multithreading = simulation.is_multithreading_enabled();
+}
+
+
+void SessionRecorder::record(const ParticleSimulation& simulation, const SimulationCommand& command) {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    recording.edits.push_back({ simulation.get_tick(), static_cast<std::uint32_t>(elapsed.count()), command });
+}
+
+
+void SessionRecorder::on_step(const ParticleSimulation& simulation) {
+    if (checksum_interval != 0 and simulation.get_tick() % checksum_interval == 0) {
+        recording.checksums.push_back({ simulation.get_tick(), simulation.get_checksum() });
+    }
+}
+
+
+const SessionRecording& SessionRecorder::finish(const ParticleSimulation& simulation) {
+    recording.end_tick = simulation.get_tick();
+    recording.end_checksum = simulation.get_checksum();
+
+    return recording;
+}
+
+
+//////////////////////////////////////////
+// Public functions for SessionReplayer //
+//////////////////////////////////////////
+
+SessionReplayer::SessionReplayer(const SessionRecording& recording) : recording(recording) {}
+
+
+bool SessionReplayer::step(ParticleSimulation& simulation) {
+    if (finished) {
+        return false;
+    }
+
+    // Edits made after the last step are part of the final state
+    if (simulation.get_tick() >= recording.end_tick) {
+        apply_edits(simulation);
+        check(recording.end_tick, recording.end_checksum, simulation.get_checksum());
+
+        finished = true;
+        return false;
+    }
+
+    apply_edits(simulation);
+    simulation.update();
+
+    const std::uint32_t tick = simulation.get_tick();
+
+    while (next_checksum < recording.checksums.size() and recording.checksums[next_checksum].tick <= tick) {
+        if (recording.checksums[next_checksum].tick == tick) {
+            check(tick, recording.checksums[next_checksum].value, simulation.get_checksum());
+        }
+        next_checksum++;
+    }
+
+    return true;
+}
+
+
+bool SessionReplayer::is_finished() const {
+    return finished;
+}
+
+
+std::size_t SessionReplayer::get_checked_count() const {
+    return checked_count;
+}
+
+
+std::optional<std::uint32_t> SessionReplayer::get_first_mismatch() const {
+    return first_mismatch;
+}
+
+
+///////////////////////////////////////////
+// Private functions for SessionReplayer //
+///////////////////////////////////////////
+
+void SessionReplayer::apply_edits(ParticleSimulation& simulation) {
+    // Pausing and stepping only decide which tick later edits land on, which is already recorded
+    while (next_edit < recording.edits.size() and recording.edits[next_edit].tick <= simulation.get_tick()) {
+        const SimulationCommand& command = recording.edits[next_edit].command;
+
+        if (command.type == SimulationCommand::Type::Paint) {
+            simulation.paint(command.brush_size, command.cell, command.material);
+        }
+        else if (command.type == SimulationCommand::Type::Line) {
+            simulation.fill_line(command.from, command.cell, command.brush_size, command.material);
+        }
+
+        next_edit++;
+    }
+}
+
+
+void SessionReplayer::check(std::uint32_t tick, std::uint64_t expected, std::uint64_t actual) {
+    checked_count++;
+
+    if (expected != actual and not first_mismatch) {
+        first_mismatch = tick;
+    }
+}
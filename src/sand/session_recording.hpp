@@ -0,0 +1,139 @@
+﻿#pragma once
+
+#include <SFML/System/Vector2.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "particle_simulation.hpp"
+#include "simulation_command.hpp"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Everything needed to replay a session: the starting world, every edit and checksums 
+// The world starts empty with the recorded size and seed, edits are applied in order         
+// before the step that leaves tick, like SimulationRunner applies them                       
+////////////////////////////////////////////////////////////////////////////////////////////////
+struct SessionRecording {
+	struct Edit {
+		std::uint32_t tick;
+
+		// Milliseconds since the recording started, only kept to show when the edit was made
+		std::uint32_t time_ms;
+
+		SimulationCommand command;
+	};
+
+	struct Checksum {
+		std::uint32_t tick;
+		std::uint64_t value;
+	};
+
+	sf::Vector2i size;
+	std::uint64_t seed = 0;
+	bool multithreading = true;
+
+	std::vector<Edit> edits;
+	std::vector<Checksum> checksums;
+
+	std::uint32_t end_tick = 0;
+	std::uint64_t end_checksum = 0;
+
+	////////////////////////////////////////////////////////////////////////
+	// \brief Writes the recording as text, one line per edit or checksum 
+	////////////////////////////////////////////////////////////////////////
+	bool save(const std::string& path) const;
+
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Reads a recording written by save                                                    
+	// \param error Receives why the file could not be read, if given                              
+	// \return false if the file is missing, malformed or was recorded with another material table 
+	// or by an older version whose checksums can no longer match                                  
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	bool load(const std::string& path, std::string* error = nullptr);
+
+	///////////////////////////////////////////////////////////////////
+	// \brief Returns an empty simulation to replay the recording on 
+	///////////////////////////////////////////////////////////////////
+	std::unique_ptr<ParticleSimulation> create_simulation() const;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// \brief Collects the edits and checksums of a session as it is played            
+// Used by one thread at a time, whichever one is applying edits and running steps 
+/////////////////////////////////////////////////////////////////////////////////////
+class SessionRecorder {
+public:
+	////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Starts a recording of a fresh simulation                                    
+	// \param simulation The simulation being recorded, it must not have run any step yet 
+	// \param checksum_interval A checksum is taken every this many ticks, 0 takes none   
+	////////////////////////////////////////////////////////////////////////////////////////
+	SessionRecorder(const ParticleSimulation& simulation, std::uint32_t checksum_interval = 60);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// \brief Logs an edit applied before the step that leaves the current tick 
+	//////////////////////////////////////////////////////////////////////////////
+	void record(const ParticleSimulation& simulation, const SimulationCommand& command);
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// \brief Takes a checksum when the tick the simulation just reached is due for one 
+	//////////////////////////////////////////////////////////////////////////////////////
+	void on_step(const ParticleSimulation& simulation);
+
+	/////////////////////////////////////////////////////////////////////////
+	// \brief Ends the recording at the current tick with a final checksum 
+	/////////////////////////////////////////////////////////////////////////
+	const SessionRecording& finish(const ParticleSimulation& simulation);
+
+private:
+	SessionRecording recording;
+
+	std::uint32_t checksum_interval;
+
+	std::chrono::steady_clock::time_point start;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Feeds a recording into a simulation one step at a time and checks its checksums 
+////////////////////////////////////////////////////////////////////////////////////////////
+class SessionReplayer {
+public:
+	SessionReplayer(const SessionRecording& recording);
+
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Applies the edits recorded for the current tick and runs one step                 
+	// At the end of the recording the last edits are applied and the final checksum is checked 
+	// \return false once the recording has ended                                               
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	bool step(ParticleSimulation& simulation);
+
+	bool is_finished() const;
+
+	std::size_t get_checked_count() const;
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the first tick whose checksum did not match, nothing while all matched 
+	///////////////////////////////////////////////////////////////////////////////////////////
+	std::optional<std::uint32_t> get_first_mismatch() const;
+
+private:
+	void apply_edits(ParticleSimulation& simulation);
+
+	void check(std::uint32_t tick, std::uint64_t expected, std::uint64_t actual);
+
+	const SessionRecording& recording;
+
+	std::size_t next_edit = 0;
+	std::size_t next_checksum = 0;
+
+	bool finished = false;
+	std::size_t checked_count = 0;
+	std::optional<std::uint32_t> first_mismatch;
+};
@@ -0,0 +1,31 @@
+﻿#pragma once
+
+#include <SFML/System/Vector2.hpp>
+
+#include <cstdint>
+
+#include "particles.hpp"
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief One edit of a running simulation, applied by the simulation thread between two ticks 
+// Paint uses brush_size, cell and material, Line paints from from to cell with them too and   
+// the other types carry no data                                                               
+/////////////////////////////////////////////////////////////////////////////////////////////////
+struct SimulationCommand {
+	enum class Type : std::uint8_t {
+		Paint,
+		Pause,
+		Resume,
+		Step,
+		Line,
+	};
+
+	Type type = Type::Paint;
+
+	int brush_size = 0;
+	sf::Vector2i cell;
+	MaterialID material = MaterialID::Air;
+
+	sf::Vector2i from;
+};
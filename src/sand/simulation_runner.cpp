@@ -0,0 +1,251 @@
+﻿#include <chrono>
+
+#include "world_file.hpp"
+#include "src/profiler/profiler.hpp"
+
+#include "simulation_runner.hpp"
+
+
+///////////////////////////////////////////
+// Public functions for SimulationRunner //
+///////////////////////////////////////////
+
+SimulationRunner::SimulationRunner(ParticleSimulation& simulation) : simulation(simulation) {}
+
+
+SimulationRunner::~SimulationRunner() {
+    stop();
+}
+
+
+void SimulationRunner::start() {
+    if (thread.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(command_mutex);
+        stop_requested = false;
+    }
+
+    // The window has something to draw before the first tick finishes
+    publish();
+
+    thread = std::thread(&SimulationRunner::run, this);
+}
+
+
+void SimulationRunner::stop() {
+    if (not thread.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(command_mutex);
+        stop_requested = true;
+    }
+    command_ready.notify_one();
+
+    thread.join();
+
+    if (save_thread.joinable()) {
+        save_thread.join();
+    }
+}
+
+
+bool SimulationRunner::is_running() const {
+    return thread.joinable();
+}
+
+
+void SimulationRunner::set_tick_rate(unsigned int ticks_per_second) {
+    tick_rate.store(ticks_per_second, std::memory_order_relaxed);
+}
+
+
+void SimulationRunner::push(const SimulationCommand& command) {
+    {
+        std::lock_guard lock(command_mutex);
+        pending_commands.push_back(command);
+    }
+    command_ready.notify_one();
+}
+
+
+const WorldSnapshot& SimulationRunner::get_snapshot() {
+    if (middle.load(std::memory_order_relaxed) & fresh_flag) {
+        front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+    }
+
+    return snapshots[front];
+}
+
+
+float SimulationRunner::get_ticks_per_second() const {
+    return ticks_per_second.load(std::memory_order_relaxed);
+}
+
+
+void SimulationRunner::save(const std::string& path) {
+    {
+        std::lock_guard lock(command_mutex);
+        pending_save_path = path;
+    }
+    saving.store(true, std::memory_order_relaxed);
+    command_ready.notify_one();
+}
+
+
+void SimulationRunner::set_recorder(SessionRecorder* recorder) {
+    this->recorder = recorder;
+}
+
+
+bool SimulationRunner::is_saving() const {
+    return saving.load(std::memory_order_relaxed);
+}
+
+
+bool SimulationRunner::did_last_save_fail() const {
+    return save_failed.load(std::memory_order_relaxed);
+}
+
+
+////////////////////////////////////////////
+// Private functions for SimulationRunner //
+////////////////////////////////////////////
+
+void SimulationRunner::run() {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<SimulationCommand> commands;
+    std::optional<std::string> save_path;
+
+    clock::time_point next_tick = clock::now();
+    clock::time_point second_start = next_tick;
+    int ticks_this_second = 0;
+
+    while (true) {
+        {
+            std::unique_lock lock(command_mutex);
+
+            // A paused simulation has nothing to do until it is edited or stopped
+            if (paused) {
+                ticks_per_second.store(0.f, std::memory_order_relaxed);
+
+                command_ready.wait(lock, [this] { return stop_requested or not pending_commands.empty() or pending_save_path; });
+
+                next_tick = clock::now();
+                second_start = next_tick;
+                ticks_this_second = 0;
+            }
+            else if (tick_rate.load(std::memory_order_relaxed) != 0) {
+                command_ready.wait_until(lock, next_tick, [this] { return stop_requested; });
+            }
+
+            if (stop_requested) {
+                break;
+            }
+
+            commands.swap(pending_commands);
+            save_path.swap(pending_save_path);
+        }
+
+        bool step = false;
+
+        for (const SimulationCommand& command : commands) {
+            if (recorder) {
+                recorder->record(simulation, command);
+            }
+
+            switch (command.type) {
+                case SimulationCommand::Type::Paint:
+                    simulation.paint(command.brush_size, command.cell, command.material);
+                    break;
+
+                case SimulationCommand::Type::Line:
+                    simulation.fill_line(command.from, command.cell, command.brush_size, command.material);
+                    break;
+
+                case SimulationCommand::Type::Pause:
+                    paused = true;
+                    break;
+
+                case SimulationCommand::Type::Resume:
+                    paused = false;
+                    break;
+
+                case SimulationCommand::Type::Step:
+                    step = true;
+                    break;
+            }
+        }
+
+        commands.clear();
+
+        if (not paused or step) {
+            simulation.update();
+            ticks_this_second++;
+
+            if (recorder) {
+                recorder->on_step(simulation);
+            }
+        }
+
+        publish();
+
+        if (save_path) {
+            start_save(*save_path);
+            save_path.reset();
+        }
+
+        const clock::time_point now = clock::now();
+
+        if (const unsigned int rate = tick_rate.load(std::memory_order_relaxed); rate != 0) {
+            const clock::duration period = std::chrono::nanoseconds(1'000'000'000 / rate);
+
+            // Running late by up to one tick is caught up, anything more is dropped
+            // so a slow stretch is not followed by a burst of ticks
+            next_tick += period;
+            if (now - next_tick > period) {
+                next_tick = now;
+            }
+        }
+        else {
+            next_tick = now;
+        }
+
+        if (now - second_start >= std::chrono::seconds(1)) {
+            ticks_per_second.store(ticks_this_second / std::chrono::duration<float>(now - second_start).count(), std::memory_order_relaxed);
+            second_start = now;
+            ticks_this_second = 0;
+        }
+    }
+}
+
+
+void SimulationRunner::start_save(const std::string& path) {
+    // The snapshot is still being written by the previous save
+    if (save_thread.joinable()) {
+        save_thread.join();
+    }
+
+    simulation.capture(save_snapshot);
+    saving.store(true, std::memory_order_relaxed);
+
+    save_thread = std::thread([this, path] {
+        PROFILE_SCOPE("save_world");
+        save_failed.store(not save_world(path, save_snapshot), std::memory_order_relaxed);
+        saving.store(false, std::memory_order_relaxed);
+    });
+}
+
+
+void SimulationRunner::publish() {
+    PROFILE_SCOPE("publish");
+
+    simulation.capture(snapshots[back]);
+
+    back = middle.exchange(back | fresh_flag, std::memory_order_acq_rel) & index_mask;
+}
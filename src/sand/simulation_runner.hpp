@@ -0,0 +1,123 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "particle_simulation.hpp"
+#include "simulation_command.hpp"
+#include "session_recording.hpp"
+#include "world_snapshot.hpp"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// \brief Runs a ParticleSimulation on its own thread at a fixed tick rate               
+// The window thread hands edits over through a queue and draws the newest finished tick 
+// from a triple buffered WorldSnapshot, so neither side ever waits for the other        
+///////////////////////////////////////////////////////////////////////////////////////////
+class SimulationRunner {
+public:
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Prepares a runner for a simulation, the thread is started by start()                
+	// \param simulation The simulation to run, only the runner thread may touch it while running 
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	SimulationRunner(ParticleSimulation& simulation);
+
+	~SimulationRunner();
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Publishes the current state of the simulation and starts the simulation thread 
+	///////////////////////////////////////////////////////////////////////////////////////////
+	void start();
+
+	//////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Stops the simulation thread after the tick in progress, queued edits are kept 
+	//////////////////////////////////////////////////////////////////////////////////////////
+	void stop();
+
+	bool is_running() const;
+
+	////////////////////////////////////////////////////////////////////////////////
+	// \brief Sets how many ticks run per second, 0 runs them as fast as possible 
+	////////////////////////////////////////////////////////////////////////////////
+	void set_tick_rate(unsigned int ticks_per_second);
+
+	///////////////////////////////////////////////////////////////
+	// \brief Queues an edit, it is applied before the next tick 
+	///////////////////////////////////////////////////////////////
+	void push(const SimulationCommand& command);
+
+	////////////////////////////////////////////////////////////////
+	// \brief Returns the newest finished tick                    
+	// The snapshot stays valid and unchanged until the next call 
+	////////////////////////////////////////////////////////////////
+	const WorldSnapshot& get_snapshot();
+
+	///////////////////////////////////////////////////////////////////
+	// \brief Returns the number of ticks run during the last second 
+	///////////////////////////////////////////////////////////////////
+	float get_ticks_per_second() const;
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Writes the world to a file on a background thread, ticks keep running meanwhile               
+	// The state after the tick in progress is saved, an earlier save still being written is finished first 
+	// \param path Where to write the world, see save_world                                                 
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////
+	void save(const std::string& path);
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Logs every edit and step the simulation thread runs, may only be changed while stopped 
+	// \param recorder The recorder to feed, nullptr stops recording                                 
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	void set_recorder(SessionRecorder* recorder);
+
+	bool is_saving() const;
+
+	bool did_last_save_fail() const;
+
+private:
+	void run();
+
+	void publish();
+
+	void start_save(const std::string& path);
+
+	ParticleSimulation& simulation;
+
+	std::thread thread;
+
+	// Guards the queue and stop_requested, the simulation thread sleeps on it while paused
+	std::mutex command_mutex;
+	std::condition_variable command_ready;
+	std::vector<SimulationCommand> pending_commands;
+	std::optional<std::string> pending_save_path;
+	bool stop_requested = false;
+
+	// Only touched by the simulation thread
+	bool paused = false;
+	SessionRecorder* recorder = nullptr;
+
+	std::atomic<unsigned int> tick_rate = 0;
+	std::atomic<float> ticks_per_second = 0.f;
+
+	// Triple buffer: the simulation thread owns back, the window thread owns front and
+	// the two swap their buffer with middle, which is flagged when it holds a new tick
+	static constexpr int fresh_flag = 4;
+	static constexpr int index_mask = 3;
+
+	std::array<WorldSnapshot, 3> snapshots;
+	int back = 0;
+	int front = 1;
+	std::atomic<int> middle = 2;
+
+	// Kept between saves so capturing only copies the chunks that changed since the last one
+	WorldSnapshot save_snapshot;
+	std::thread save_thread;
+	std::atomic<bool> saving = false;
+	std::atomic<bool> save_failed = false;
+};
@@ -0,0 +1,182 @@
+﻿#include <algorithm>
+#include <cmath>
+
+#include "thermal.hpp"
+
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define SAND_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+static constexpr float min_temp = -273.0f;
+static constexpr float max_temp = 5000.0f;
+
+
+/////////////////////
+// Scalar fallback //
+/////////////////////
+
+// The additions are grouped the same way as in the simd kernels, so every
+// kernel produces bit identical temperatures
+static float diffuse_row_scalar(const float* const heat[3], const float* const solid[3], const float* temps, float* out, int begin, int count, float transfer) {
+    float max_delta = 0.0f;
+
+    for (int x = begin; x < count; x++) {
+        float sum = (heat[0][x - 1] + heat[0][x]) + heat[0][x + 1];
+        sum = sum + (heat[1][x - 1] + heat[1][x + 1]);
+        sum = sum + ((heat[2][x - 1] + heat[2][x]) + heat[2][x + 1]);
+
+        float neighbors = (solid[0][x - 1] + solid[0][x]) + solid[0][x + 1];
+        neighbors = neighbors + (solid[1][x - 1] + solid[1][x + 1]);
+        neighbors = neighbors + ((solid[2][x - 1] + solid[2][x]) + solid[2][x + 1]);
+
+        const float temp = temps[x];
+        float new_temp = temp;
+
+        if (solid[1][x] > 0.0f) {
+            new_temp = std::min(std::max(temp + transfer * (sum - neighbors * temp), min_temp), max_temp);
+        }
+
+        out[x] = new_temp;
+        max_delta = std::max(max_delta, std::abs(new_temp - temp));
+    }
+
+    return max_delta;
+}
+
+
+static float diffuse_row_scalar(const float* const heat[3], const float* const solid[3], const float* temps, float* out, int count, float transfer) {
+    return diffuse_row_scalar(heat, solid, temps, out, 0, count, transfer);
+}
+
+
+#ifdef SAND_X86_SIMD
+
+/////////////////
+// SSE2 kernel //
+/////////////////
+
+static float diffuse_row_sse2(const float* const heat[3], const float* const solid[3], const float* temps, float* out, int count, float transfer) {
+    const __m128 transfer_v = _mm_set1_ps(transfer);
+    const __m128 min_v = _mm_set1_ps(min_temp);
+    const __m128 max_v = _mm_set1_ps(max_temp);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 max_delta = _mm_setzero_ps();
+
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(heat[0] + x - 1), _mm_loadu_ps(heat[0] + x)), _mm_loadu_ps(heat[0] + x + 1));
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_loadu_ps(heat[1] + x - 1), _mm_loadu_ps(heat[1] + x + 1)));
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(heat[2] + x - 1), _mm_loadu_ps(heat[2] + x)), _mm_loadu_ps(heat[2] + x + 1)));
+
+        __m128 neighbors = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(solid[0] + x - 1), _mm_loadu_ps(solid[0] + x)), _mm_loadu_ps(solid[0] + x + 1));
+        neighbors = _mm_add_ps(neighbors, _mm_add_ps(_mm_loadu_ps(solid[1] + x - 1), _mm_loadu_ps(solid[1] + x + 1)));
+        neighbors = _mm_add_ps(neighbors, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(solid[2] + x - 1), _mm_loadu_ps(solid[2] + x)), _mm_loadu_ps(solid[2] + x + 1)));
+
+        const __m128 temp = _mm_loadu_ps(temps + x);
+
+        __m128 new_temp = _mm_add_ps(temp, _mm_mul_ps(transfer_v, _mm_sub_ps(sum, _mm_mul_ps(neighbors, temp))));
+        new_temp = _mm_min_ps(_mm_max_ps(new_temp, min_v), max_v);
+
+        // Air keeps its temperature
+        const __m128 is_solid = _mm_cmpgt_ps(_mm_loadu_ps(solid[1] + x), _mm_setzero_ps());
+        new_temp = _mm_or_ps(_mm_and_ps(is_solid, new_temp), _mm_andnot_ps(is_solid, temp));
+
+        _mm_storeu_ps(out + x, new_temp);
+        max_delta = _mm_max_ps(max_delta, _mm_and_ps(_mm_sub_ps(new_temp, temp), abs_mask));
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, max_delta);
+
+    const float tail = diffuse_row_scalar(heat, solid, temps, out, x, count, transfer);
+    return std::max({ lanes[0], lanes[1], lanes[2], lanes[3], tail });
+}
+
+
+/////////////////
+// AVX2 kernel //
+/////////////////
+
+__attribute__((target("avx2")))
+static float diffuse_row_avx2(const float* const heat[3], const float* const solid[3], const float* temps, float* out, int count, float transfer) {
+    const __m256 transfer_v = _mm256_set1_ps(transfer);
+    const __m256 min_v = _mm256_set1_ps(min_temp);
+    const __m256 max_v = _mm256_set1_ps(max_temp);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 max_delta = _mm256_setzero_ps();
+
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(heat[0] + x - 1), _mm256_loadu_ps(heat[0] + x)), _mm256_loadu_ps(heat[0] + x + 1));
+        sum = _mm256_add_ps(sum, _mm256_add_ps(_mm256_loadu_ps(heat[1] + x - 1), _mm256_loadu_ps(heat[1] + x + 1)));
+        sum = _mm256_add_ps(sum, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(heat[2] + x - 1), _mm256_loadu_ps(heat[2] + x)), _mm256_loadu_ps(heat[2] + x + 1)));
+
+        __m256 neighbors = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(solid[0] + x - 1), _mm256_loadu_ps(solid[0] + x)), _mm256_loadu_ps(solid[0] + x + 1));
+        neighbors = _mm256_add_ps(neighbors, _mm256_add_ps(_mm256_loadu_ps(solid[1] + x - 1), _mm256_loadu_ps(solid[1] + x + 1)));
+        neighbors = _mm256_add_ps(neighbors, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(solid[2] + x - 1), _mm256_loadu_ps(solid[2] + x)), _mm256_loadu_ps(solid[2] + x + 1)));
+
+        const __m256 temp = _mm256_loadu_ps(temps + x);
+
+        __m256 new_temp = _mm256_add_ps(temp, _mm256_mul_ps(transfer_v, _mm256_sub_ps(sum, _mm256_mul_ps(neighbors, temp))));
+        new_temp = _mm256_min_ps(_mm256_max_ps(new_temp, min_v), max_v);
+
+        // Air keeps its temperature
+        const __m256 is_solid = _mm256_cmp_ps(_mm256_loadu_ps(solid[1] + x), _mm256_setzero_ps(), _CMP_GT_OQ);
+        new_temp = _mm256_blendv_ps(temp, new_temp, is_solid);
+
+        _mm256_storeu_ps(out + x, new_temp);
+        max_delta = _mm256_max_ps(max_delta, _mm256_and_ps(_mm256_sub_ps(new_temp, temp), abs_mask));
+    }
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, max_delta);
+
+    const float tail = diffuse_row_scalar(heat, solid, temps, out, x, count, transfer);
+    return std::max({ lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], lanes[5], lanes[6], lanes[7], tail });
+}
+
+#endif
+
+
+//////////////////////
+// Kernel selection //
+//////////////////////
+
+using DiffuseRowKernel = float (*)(const float* const[3], const float* const[3], const float*, float*, int, float);
+
+struct ThermalKernel {
+    DiffuseRowKernel function;
+    const char* name;
+};
+
+
+static ThermalKernel select_thermal_kernel() {
+#ifdef SAND_X86_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return { diffuse_row_avx2, "avx2" };
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        return { diffuse_row_sse2, "sse2" };
+    }
+#endif
+
+    return { diffuse_row_scalar, "scalar" };
+}
+
+
+static const ThermalKernel thermal_kernel = select_thermal_kernel();
+
+
+float diffuse_heat_row(const float* const heat_rows[3], const float* const solid_rows[3], const float* temps, float* out, int count, float transfer) {
+    return thermal_kernel.function(heat_rows, solid_rows, temps, out, count, transfer);
+}
+
+
+const char* get_thermal_kernel_name() {
+    return thermal_kernel.name;
+}
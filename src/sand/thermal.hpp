@@ -0,0 +1,20 @@
+﻿#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Diffuses heat along one row of cells into a separate output buffer                       
+// \param heat_rows Temperature times the solid mask for the rows above, at and below the row      
+// \param solid_rows 1 for non air cells and 0 for air, for the same three rows                    
+// \param temps Current temperatures of the row                                                    
+// \param out Receives the new temperatures of the row, air cells keep their temperature           
+// \param count Number of cells in the row, index -1 and count must be readable in the padded rows 
+// \param transfer Fraction of the difference exchanged with every non air neighbor                
+// \return The largest absolute temperature change in the row                                      
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+float diffuse_heat_row(const float* const heat_rows[3], const float* const solid_rows[3], const float* temps, float* out, int count, float transfer);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Returns the name of the row kernel picked for this cpu ("avx2", "sse2" or "scalar") 
+////////////////////////////////////////////////////////////////////////////////////////////////
+const char* get_thermal_kernel_name();
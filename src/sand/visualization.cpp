@@ -0,0 +1,188 @@
+﻿#include <algorithm>
+#include <cmath>
+
+#include "visualization.hpp"
+
+
+using TemperaturePalette = std::array<sf::Color, CellColorizer::temperature_palette_size>;
+using ActivityPalette = std::array<sf::Color, 256>;
+
+
+static sf::Color temperature_color(float t) {
+    if (t <= 0.0f) {
+        // Purple fades to black as it gets colder
+        float ratio = (t + 273.0f) / 273.0f; // maps [-273, 0] → [0, 1]
+        unsigned char r = static_cast<unsigned char>(75 * ratio);  // from 0 to 75
+        unsigned char g = static_cast<unsigned char>(0);
+        unsigned char b = static_cast<unsigned char>(130 * ratio); // from 0 to 130
+        return sf::Color(r, g, b);
+    }
+    else if (t <= 1000.0f) {
+        // Black to Red
+        float ratio = t / 1000.0f;
+        return sf::Color(
+            static_cast<unsigned char>(255 * ratio),
+            0,
+            255
+        );
+    }
+    else if (t <= 2000.0f) {
+        // Red to Yellow (increasing green)
+        float ratio = (t - 1000.0f) / 1000.0f;
+        return sf::Color(
+            255,
+            static_cast<unsigned char>(255 * ratio),
+            0
+        );
+    }
+    else {
+        // Yellow to White (increasing blue), white from 3000 up
+        float ratio = std::min((t - 2000.0f) / 1000.0f, 1.0f);
+        return sf::Color(
+            255,
+            255,
+            static_cast<unsigned char>(255 * ratio)
+        );
+    }
+}
+
+
+static const TemperaturePalette& get_temperature_palette() {
+    static const TemperaturePalette palette = [] {
+        TemperaturePalette result;
+        const float step = (CellColorizer::temperature_palette_max - CellColorizer::temperature_palette_min) / CellColorizer::temperature_palette_size;
+
+        for (int i = 0; i < CellColorizer::temperature_palette_size; i++) {
+            result[i] = temperature_color(CellColorizer::temperature_palette_min + (i + 0.5f) * step);
+        }
+        return result;
+    }();
+
+    return palette;
+}
+
+
+static sf::Color get_temperature_palette_color(float t) {
+    const TemperaturePalette& palette = get_temperature_palette();
+    const float scale = CellColorizer::temperature_palette_size / (CellColorizer::temperature_palette_max - CellColorizer::temperature_palette_min);
+    const float position = std::clamp((t - CellColorizer::temperature_palette_min) * scale, 0.0f, CellColorizer::temperature_palette_size - 1.0f);
+
+    return palette[static_cast<int>(position)];
+}
+
+
+static const ActivityPalette& get_activity_palette() {
+    // Cells that just moved are white hot and cool down to dark blue over 255 steps
+    static const ActivityPalette palette = [] {
+        ActivityPalette result;
+
+        for (int age = 0; age < 256; age++) {
+            const float heat = 1.0f - age / 255.0f;
+            result[age] = sf::Color(
+                static_cast<unsigned char>(255 * heat),
+                static_cast<unsigned char>(255 * heat * heat),
+                static_cast<unsigned char>(64 + 191 * heat * heat * heat)
+            );
+        }
+        return result;
+    }();
+
+    return palette;
+}
+
+
+const char* get_display_mode_name(DisplayMode mode) {
+    switch (mode) {
+        case DisplayMode::Standard: return "standard";
+        case DisplayMode::Temperature: return "temperature";
+        case DisplayMode::Density: return "density";
+        case DisplayMode::Material: return "material";
+        case DisplayMode::Activity: return "activity";
+        default: return "none";
+    }
+}
+
+
+DisplayMode next_display_mode(DisplayMode mode) {
+    return static_cast<DisplayMode>((static_cast<int>(mode) + 1) % static_cast<int>(DisplayMode::COUNT));
+}
+
+
+CellColorizer::CellColorizer(DisplayMode mode, std::uint32_t tick) : mode(mode), tick(tick) {
+    material_palette.fill(sf::Color::Black);
+
+    float max_density = 0.0f;
+    for (const Material& material : materials.data) {
+        max_density = std::max(max_density, material.density);
+    }
+
+    for (std::size_t i = 1; i < static_cast<std::size_t>(MaterialID::COUNT); i++) {
+        const Material& material = materials.data[i];
+
+        if (mode == DisplayMode::Material) {
+            material_palette[i] = material_info.data[i].base_color;
+        }
+        else if (mode == DisplayMode::Density and max_density > 0.0f) {
+            // The square root spreads the many light materials further apart
+            const unsigned char shade = static_cast<unsigned char>(32 + 223 * std::sqrt(material.density / max_density));
+            material_palette[i] = sf::Color(shade, shade, shade);
+        }
+    }
+}
+
+
+void CellColorizer::colorize(const CellRun& run, sf::Color* out, int count) const {
+    switch (mode) {
+        case DisplayMode::Temperature:
+            for (int i = 0; i < count; i++) {
+                // Air keeps its own color like in the standard view
+                out[i] = run.materials[i] == MaterialID::Air ? get_cell_color(MaterialID::Air, run.shades[i]) : get_temperature_palette_color(run.temps[i]);
+            }
+            break;
+
+        case DisplayMode::Density:
+        case DisplayMode::Material:
+            for (int i = 0; i < count; i++) {
+                out[i] = material_palette[static_cast<std::uint8_t>(run.materials[i])];
+            }
+            break;
+
+        case DisplayMode::Activity: {
+            const ActivityPalette& palette = get_activity_palette();
+
+            for (int i = 0; i < count; i++) {
+                const std::uint32_t age = std::min<std::uint32_t>(tick - run.moved_ticks[i], 255);
+                out[i] = run.materials[i] == MaterialID::Air ? get_cell_color(MaterialID::Air, run.shades[i]) : palette[age];
+            }
+            break;
+        }
+
+        default:
+            for (int i = 0; i < count; i++) {
+                out[i] = get_cell_color(run.materials[i], run.shades[i]);
+            }
+            break;
+    }
+}
+
+
+void CellColorizer::colorize(const TexelRun& run, sf::Color* out, int count) const {
+    if (mode != DisplayMode::Temperature) {
+        std::copy_n(run.colors, count, out);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const sf::Color heat = get_temperature_palette_color(run.temps[i]);
+        const sf::Color color = run.colors[i];
+
+        // Air keeps its own color, so blocks that are partly air fade towards their standard color
+        const float matter = run.matter[i];
+        out[i] = sf::Color(
+            static_cast<std::uint8_t>(color.r + (heat.r - color.r) * matter),
+            static_cast<std::uint8_t>(color.g + (heat.g - color.g) * matter),
+            static_cast<std::uint8_t>(color.b + (heat.b - color.b) * matter),
+            static_cast<std::uint8_t>(color.a + (heat.a - color.a) * matter)
+        );
+    }
+}
@@ -0,0 +1,86 @@
+﻿#pragma once
+
+#include <SFML/Graphics/Color.hpp>
+
+#include <array>
+#include <cstdint>
+
+#include "particles.hpp"
+
+
+enum class DisplayMode : uint8_t {
+    Standard,
+    Temperature,
+    Density,
+    Material,
+    Activity,
+    COUNT
+};
+
+
+////////////////////////////////////////////////////////////////
+// \brief Returns the name shown in the ui for a display mode 
+////////////////////////////////////////////////////////////////
+const char* get_display_mode_name(DisplayMode mode);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// \brief Returns the display mode after mode, wrapping around to Standard 
+/////////////////////////////////////////////////////////////////////////////
+DisplayMode next_display_mode(DisplayMode mode);
+
+
+// One contiguous run of cells, every pointer points at the first cell of the run
+struct CellRun {
+    const MaterialID* materials;
+    const float* temps;
+    const std::uint8_t* shades;
+    const std::uint32_t* moved_ticks;
+};
+
+
+// One contiguous run of downsampled texels, see LodPyramid
+struct TexelRun {
+    const sf::Color* colors;
+    const float* temps;
+    const float* matter;
+};
+
+
+class CellColorizer {
+public:
+	////////////////////////////////////////////////////////////////////////////
+	// \brief Prepares the palettes for one frame of a display mode           
+	// \param mode The display mode to colorize for                           
+	// \param tick The current simulation step, used to age the activity view 
+	////////////////////////////////////////////////////////////////////////////
+	CellColorizer(DisplayMode mode, std::uint32_t tick);
+
+	////////////////////////////////////////////////////////////////////////
+	// \brief Maps a run of cells through the palette of the display mode 
+	// \param run The cells to colorize                                   
+	// \param out Receives one color per cell                             
+	// \param count The number of cells in the run                        
+	////////////////////////////////////////////////////////////////////////
+	void colorize(const CellRun& run, sf::Color* out, int count) const;
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// \brief Maps a run of downsampled texels through the palette of the display mode   
+	// Only the temperature view has a palette for them, the other views show the colors 
+	// \param run The texels to colorize                                                 
+	// \param out Receives one color per texel                                           
+	// \param count The number of texels in the run                                      
+	///////////////////////////////////////////////////////////////////////////////////////
+	void colorize(const TexelRun& run, sf::Color* out, int count) const;
+
+	static constexpr int temperature_palette_size = 4096;
+	static constexpr float temperature_palette_min = -273.0f;
+	static constexpr float temperature_palette_max = 5000.0f;
+
+private:
+	DisplayMode mode;
+	std::uint32_t tick;
+
+	// Indexed by MaterialID, for the density and material views
+	std::array<sf::Color, 256> material_palette;
+};
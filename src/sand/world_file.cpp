@@ -0,0 +1,509 @@
+﻿#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "world_file.hpp"
+
+
+static_assert(std::endian::native == std::endian::little, "World files are read and written in native byte order");
+
+
+// Every plane is run length encoded. A control byte of 128 + (n - 2) is followed
+// by one value repeated n times (2 to 129), a control byte of n - 1 is followed
+// by n literal values (1 to 128). Values are compared bytewise, so any float,
+// NaN included, survives a round trip unchanged.
+
+template <typename T>
+static bool same_value(const T& a, const T& b) {
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+
+template <typename T>
+static void encode_runs(const T* values, std::size_t count, std::vector<std::uint8_t>& out) {
+    auto append = [&out](const T* first, std::size_t n) {
+        const std::uint8_t* bytes = reinterpret_cast<const std::uint8_t*>(first);
+        out.insert(out.end(), bytes, bytes + n * sizeof(T));
+    };
+
+    std::size_t i = 0;
+
+    while (i < count) {
+        std::size_t run = 1;
+        while (i + run < count and run < 129 and same_value(values[i + run], values[i])) {
+            run++;
+        }
+
+        if (run >= 2) {
+            out.push_back(static_cast<std::uint8_t>(128 + run - 2));
+            append(&values[i], 1);
+            i += run;
+            continue;
+        }
+
+        // A literal stops where the next run of two starts
+        std::size_t literal = 1;
+        while (i + literal < count and literal < 128 and not (i + literal + 1 < count and same_value(values[i + literal], values[i + literal + 1]))) {
+            literal++;
+        }
+
+        out.push_back(static_cast<std::uint8_t>(literal - 1));
+        append(&values[i], literal);
+        i += literal;
+    }
+}
+
+
+template <typename T>
+static bool decode_runs(const std::uint8_t* data, std::size_t size, T* values, std::size_t count) {
+    std::size_t position = 0;
+    std::size_t i = 0;
+
+    while (i < count) {
+        if (position >= size) {
+            return false;
+        }
+
+        const std::uint8_t control = data[position++];
+
+        if (control >= 128) {
+            const std::size_t run = control - 126;
+
+            if (position + sizeof(T) > size or i + run > count) {
+                return false;
+            }
+
+            T value;
+            std::memcpy(&value, &data[position], sizeof(T));
+            std::fill_n(&values[i], run, value);
+
+            position += sizeof(T);
+            i += run;
+        }
+        else {
+            const std::size_t literal = control + 1;
+
+            if (position + literal * sizeof(T) > size or i + literal > count) {
+                return false;
+            }
+
+            std::memcpy(&values[i], &data[position], literal * sizeof(T));
+
+            position += literal * sizeof(T);
+            i += literal;
+        }
+    }
+
+    return position == size;
+}
+
+
+template <typename T>
+static void encode_plane(const T* values, std::size_t count, std::vector<std::uint8_t>& out) {
+    const std::size_t length_position = out.size();
+    out.resize(out.size() + sizeof(std::uint32_t));
+
+    encode_runs(values, count, out);
+
+    const std::uint32_t length = static_cast<std::uint32_t>(out.size() - length_position - sizeof(std::uint32_t));
+    std::memcpy(&out[length_position], &length, sizeof(length));
+}
+
+
+template <typename T>
+static bool decode_plane(const std::uint8_t*& data, const std::uint8_t* end, T* values, std::size_t count) {
+    std::uint32_t length;
+
+    if (end - data < static_cast<std::ptrdiff_t>(sizeof(length))) {
+        return false;
+    }
+
+    std::memcpy(&length, data, sizeof(length));
+    data += sizeof(length);
+
+    if (end - data < static_cast<std::ptrdiff_t>(length) or not decode_runs(data, length, values, count)) {
+        return false;
+    }
+
+    data += length;
+    return true;
+}
+
+
+// Read only view of a whole file, mapped into memory where the platform allows it
+class MappedFile {
+public:
+    MappedFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return;
+        }
+
+        struct stat status;
+        if (fstat(descriptor, &status) == 0 and status.st_size > 0) {
+            void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+            if (mapping != MAP_FAILED) {
+                // Chunks are decoded by several threads at once, so read ahead everything
+                madvise(mapping, status.st_size, MADV_WILLNEED);
+
+                bytes = static_cast<const std::uint8_t*>(mapping);
+                length = static_cast<std::size_t>(status.st_size);
+            }
+        }
+
+        close(descriptor);
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (not file) {
+            return;
+        }
+
+        buffer.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+
+        if (file.read(reinterpret_cast<char*>(buffer.data()), buffer.size())) {
+            bytes = buffer.data();
+            length = buffer.size();
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (bytes) {
+            munmap(const_cast<std::uint8_t*>(bytes), length);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const std::uint8_t* data() const {
+        return bytes;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+private:
+    const std::uint8_t* bytes = nullptr;
+    std::size_t length = 0;
+
+#if not (defined(__unix__) || defined(__APPLE__))
+    std::vector<std::uint8_t> buffer;
+#endif
+};
+
+
+static bool is_valid_header(const WorldFileHeader& header) {
+    if (std::memcmp(header.magic, world_file_magic, sizeof(world_file_magic)) != 0 or header.version < 1 or header.version > world_file_version) {
+        return false;
+    }
+
+    if (header.width <= 0 or header.height <= 0 or header.chunk_shift > 12) {
+        return false;
+    }
+
+    const std::int64_t chunk_size = std::int64_t(1) << header.chunk_shift;
+    const std::int64_t chunk_count = ((header.width + chunk_size - 1) / chunk_size) * ((header.height + chunk_size - 1) / chunk_size);
+
+    return chunk_count == header.chunk_count;
+}
+
+
+std::uint64_t get_material_table_hash() {
+    // FNV-1a over everything that gives a stored MaterialID its meaning
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+    auto add = [&hash](const void* data, std::size_t size) {
+        const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+        for (std::size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    };
+
+    for (std::size_t i = 0; i < (std::size_t)MaterialID::COUNT; i++) {
+        add(material_info.data[i].identifier.data(), material_info.data[i].identifier.size() + 1);
+        add(&materials.data[i].behavior, sizeof(materials.data[i].behavior));
+    }
+
+    for (const Behavior& behavior : behaviors.data) {
+        add(behavior.identifier.data(), behavior.identifier.size() + 1);
+    }
+
+    return hash;
+}
+
+
+bool save_world(const std::string& path, const WorldSnapshot& snapshot) {
+    const std::size_t chunk_total = static_cast<std::size_t>(snapshot.chunk_count.x) * snapshot.chunk_count.y;
+    const std::size_t chunk_cells = std::size_t(1) << (2 * snapshot.chunk_shift);
+
+    if (chunk_total == 0 or snapshot.chunk_table.get_chunk_count() != snapshot.chunk_count or snapshot.materials.size() < chunk_cells) {
+        return false;
+    }
+
+    WorldFileHeader header;
+    std::memcpy(header.magic, world_file_magic, sizeof(world_file_magic));
+    header.version = world_file_version;
+    header.chunk_shift = static_cast<std::uint32_t>(snapshot.chunk_shift);
+    header.width = snapshot.size.x;
+    header.height = snapshot.size.y;
+    header.seed = snapshot.seed;
+    header.material_table_hash = get_material_table_hash();
+    header.tick = snapshot.tick;
+    header.chunk_count = static_cast<std::uint32_t>(chunk_total);
+
+    // Written next to the old file and swapped in at the end, so a crash never leaves half a world behind
+    const std::string temporary_path = path + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+
+    if (not file) {
+        return false;
+    }
+
+    // Chunks without cells of their own get no entry, so the table only grows with what was painted
+    std::vector<StoredChunkEntry> entries;
+
+    for (std::size_t i = 0; i < chunk_total; i++) {
+        const sf::Vector2i chunk = { static_cast<int>(i % snapshot.chunk_count.x), static_cast<int>(i / snapshot.chunk_count.x) };
+
+        if (snapshot.chunk_table.get_slot(chunk) != 0) {
+            entries.push_back({ i, 0, 0 });
+        }
+    }
+
+    const std::uint64_t stored_count = entries.size();
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(&stored_count), sizeof(stored_count));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(StoredChunkEntry));
+
+    std::uint64_t offset = sizeof(header) + sizeof(stored_count) + entries.size() * sizeof(StoredChunkEntry);
+    std::vector<std::uint8_t> encoded;
+
+    for (StoredChunkEntry& entry : entries) {
+        const sf::Vector2i chunk = { static_cast<int>(entry.index % snapshot.chunk_count.x), static_cast<int>(entry.index / snapshot.chunk_count.x) };
+        const std::size_t first = static_cast<std::size_t>(snapshot.chunk_table.get_slot(chunk)) * chunk_cells;
+
+        encoded.clear();
+        encode_plane(&snapshot.materials[first], chunk_cells, encoded);
+        encode_plane(&snapshot.temps[first], chunk_cells, encoded);
+        encode_plane(&snapshot.shades[first], chunk_cells, encoded);
+
+        entry.offset = offset;
+        entry.size = encoded.size();
+        offset += encoded.size();
+
+        file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+    }
+
+    file.seekp(sizeof(header) + sizeof(stored_count));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(StoredChunkEntry));
+    file.close();
+
+    std::error_code error;
+
+    if (not file) {
+        std::filesystem::remove(temporary_path, error);
+        return false;
+    }
+
+    std::filesystem::rename(temporary_path, path, error);
+    return not error;
+}
+
+
+std::optional<WorldFileHeader> read_world_header(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    WorldFileHeader header;
+
+    if (not file.read(reinterpret_cast<char*>(&header), sizeof(header)) or not is_valid_header(header)) {
+        return std::nullopt;
+    }
+
+    return header;
+}
+
+
+bool load_world(const std::string& path, WorldSnapshot& snapshot, ThreadPool* pool) {
+    const MappedFile file(path);
+
+    if (file.size() < sizeof(WorldFileHeader)) {
+        return false;
+    }
+
+    WorldFileHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (not is_valid_header(header) or header.material_table_hash != get_material_table_hash()) {
+        return false;
+    }
+
+    const std::size_t chunk_total = header.chunk_count;
+    const std::size_t chunk_cells = std::size_t(1) << (2 * header.chunk_shift);
+
+    // Only stored chunks get an entry, in file order
+    std::vector<StoredChunkEntry> entries;
+
+    if (header.version >= 2) {
+        std::uint64_t stored_count;
+
+        if (file.size() < sizeof(header) + sizeof(stored_count)) {
+            return false;
+        }
+
+        std::memcpy(&stored_count, file.data() + sizeof(header), sizeof(stored_count));
+
+        if (stored_count > chunk_total or (file.size() - sizeof(header) - sizeof(stored_count)) / sizeof(StoredChunkEntry) < stored_count) {
+            return false;
+        }
+
+        entries.resize(stored_count);
+        std::memcpy(entries.data(), file.data() + sizeof(header) + sizeof(stored_count), stored_count * sizeof(StoredChunkEntry));
+    }
+    else {
+        // Version 1 files store every chunk, each with an entry in grid order
+        if (file.size() < sizeof(header) + chunk_total * sizeof(ChunkEntry)) {
+            return false;
+        }
+
+        const std::uint8_t* table = file.data() + sizeof(header);
+        entries.resize(chunk_total);
+
+        for (std::size_t i = 0; i < chunk_total; i++) {
+            ChunkEntry entry;
+            std::memcpy(&entry, table + i * sizeof(ChunkEntry), sizeof(entry));
+
+            entries[i] = { i, entry.offset, entry.size };
+        }
+    }
+
+    const int chunk_size = 1 << header.chunk_shift;
+
+    snapshot.size = { header.width, header.height };
+    snapshot.chunk_count = { (header.width + chunk_size - 1) / chunk_size, (header.height + chunk_size - 1) / chunk_size };
+    snapshot.chunk_shift = static_cast<int>(header.chunk_shift);
+    snapshot.seed = header.seed;
+    snapshot.tick = header.tick;
+
+    // Chunks without an entry share slot 0, entry i gets slot i + 1
+    snapshot.chunk_table.reset(snapshot.chunk_count);
+
+    for (std::size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].index >= chunk_total) {
+            return false;
+        }
+
+        const sf::Vector2i chunk = { static_cast<int>(entries[i].index % snapshot.chunk_count.x), static_cast<int>(entries[i].index / snapshot.chunk_count.x) };
+
+        // A chunk stored twice would leave one of its slots unreachable
+        if (snapshot.chunk_table.get_slot(chunk) != 0) {
+            return false;
+        }
+
+        snapshot.chunk_table.set_slot(chunk, static_cast<std::int32_t>(i + 1));
+    }
+
+    const std::size_t len = (entries.size() + 1) * chunk_cells;
+
+    snapshot.materials.resize(len);
+    snapshot.temps.resize(len);
+    snapshot.shades.resize(len);
+    snapshot.moved_ticks.assign(len, 0);
+
+    std::fill_n(snapshot.materials.begin(), chunk_cells, MaterialID::Air);
+    std::fill_n(snapshot.temps.begin(), chunk_cells, ambient_temp);
+    std::fill_n(snapshot.shades.begin(), chunk_cells, 0);
+
+    // Nothing about the snapshot matches a live simulation, the next capture copies everything
+    snapshot.table_version = 0;
+    snapshot.version = 0;
+    snapshot.complete = false;
+
+    std::atomic<bool> valid = true;
+    std::atomic<std::size_t> particle_count = 0;
+
+    auto decode_chunk = [&](std::size_t i) {
+        const StoredChunkEntry& entry = entries[i];
+
+        if (entry.offset > file.size() or entry.size > file.size() - entry.offset) {
+            valid.store(false, std::memory_order_relaxed);
+            return;
+        }
+
+        const std::uint8_t* data = file.data() + entry.offset;
+        const std::uint8_t* end = data + entry.size;
+        const std::size_t first = (i + 1) * chunk_cells;
+
+        if (not decode_plane(data, end, &snapshot.materials[first], chunk_cells)
+            or not decode_plane(data, end, &snapshot.temps[first], chunk_cells)) {
+            valid.store(false, std::memory_order_relaxed);
+            return;
+        }
+
+        if (header.version >= 3) {
+            if (not decode_plane(data, end, &snapshot.shades[first], chunk_cells)) {
+                valid.store(false, std::memory_order_relaxed);
+                return;
+            }
+        }
+        else {
+            // Every shade of a material looks alike, so a hash of the old color picks one
+            thread_local std::vector<sf::Color> colors;
+            colors.resize(chunk_cells);
+
+            if (not decode_plane(data, end, colors.data(), chunk_cells)) {
+                valid.store(false, std::memory_order_relaxed);
+                return;
+            }
+
+            for (std::size_t cell = 0; cell < chunk_cells; cell++) {
+                std::uint32_t color_bits;
+                std::memcpy(&color_bits, &colors[cell], sizeof(color_bits));
+                snapshot.shades[first + cell] = static_cast<std::uint8_t>(mix_bits(color_bits) >> 56);
+            }
+        }
+
+        std::size_t particles = 0;
+
+        for (std::size_t cell = first; cell < first + chunk_cells; cell++) {
+            if (snapshot.materials[cell] >= MaterialID::COUNT) {
+                valid.store(false, std::memory_order_relaxed);
+                return;
+            }
+
+            particles += snapshot.materials[cell] != MaterialID::Air;
+        }
+
+        particle_count.fetch_add(particles, std::memory_order_relaxed);
+    };
+
+    if (pool) {
+        pool->parallel_for(0, entries.size(), 16, decode_chunk);
+    }
+    else {
+        for (std::size_t i = 0; i < entries.size(); i++) {
+            decode_chunk(i);
+        }
+    }
+
+    snapshot.particle_count = particle_count.load(std::memory_order_relaxed);
+
+    return valid.load(std::memory_order_relaxed);
+}
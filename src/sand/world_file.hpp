@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "world_snapshot.hpp"
+#include "src/multi-threading/thread_pool.hpp"
+
+
+// World file layout, all values little endian:
+//   WorldFileHeader
+//   u64 stored chunk count
+//   StoredChunkEntry[stored chunk count]
+//   per stored chunk: material, temperature and shade plane, each a u32 byte
+//   count followed by the plane run length encoded (see world_file.cpp)
+// Chunks are stored like WorldSnapshot stores them, padding included. Chunks
+// without an entry are air at ambient temperature, so the file grows with what
+// was painted rather than with the world.
+// Version 1 files have a ChunkEntry for every chunk of the grid instead of the
+// count and the stored entries. Before version 3 the last plane held a color per
+// cell, which loading turns into some shade.
+
+inline constexpr char world_file_magic[8] = { 'S', 'A', 'N', 'D', 'W', 'R', 'L', 'D' };
+inline constexpr std::uint32_t world_file_version = 3;
+
+
+////////////////////////////////////////////////////////////////////////////////////
+// \brief Fixed size header at the start of every world file                      
+// Followed by the entries of the stored chunks and then the chunks themselves    
+////////////////////////////////////////////////////////////////////////////////////
+struct WorldFileHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t chunk_shift;
+	std::int32_t width;
+	std::int32_t height;
+	std::uint64_t seed;
+	std::uint64_t material_table_hash;
+	std::uint32_t tick;
+	std::uint32_t chunk_count;
+};
+
+static_assert(sizeof(WorldFileHeader) == 48, "WorldFileHeader is written to disk as is");
+
+
+// Where a chunk is in a version 1 file, which has one per chunk of the grid
+struct ChunkEntry {
+	std::uint64_t offset;
+	std::uint64_t size;
+};
+
+
+// Where a stored chunk is in the file, index is its row * chunk columns + column
+struct StoredChunkEntry {
+	std::uint64_t index;
+	std::uint64_t offset;
+	std::uint64_t size;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////
+// \brief Returns a hash of the material and behavior tables                         
+// Files written with a different table store different materials under the same ids 
+///////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t get_material_table_hash();
+
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// \brief Writes a snapshot to a world file, replacing the file only once it is complete 
+// \param path Where to write the world                                                  
+// \param snapshot The world to write, usually filled by ParticleSimulation::capture     
+// \return false if the file could not be written                                        
+///////////////////////////////////////////////////////////////////////////////////////////
+bool save_world(const std::string& path, const WorldSnapshot& snapshot);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Reads only the header of a world file                                             
+// \param path The world file                                                               
+// \return nothing if the file is missing, too short or not a world file of a known version 
+//////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<WorldFileHeader> read_world_header(const std::string& path);
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Reads a world file into a snapshot, ready for the ParticleSimulation constructor     
+// The file is memory mapped where possible and its chunks are decoded in parallel             
+// \param path The world file                                                                  
+// \param snapshot Receives the world, moved ticks are all 0                                   
+// \param pool Decodes the chunks when given, otherwise they are decoded on the calling thread 
+// \return false if the file is missing, corrupt or was written with another material table    
+/////////////////////////////////////////////////////////////////////////////////////////////////
+bool load_world(const std::string& path, WorldSnapshot& snapshot, ThreadPool* pool = nullptr);
@@ -0,0 +1,33 @@
+﻿#include "world_snapshot.hpp"
+
+
+//////////////////////////////
+// Functions for CellPlanes //
+//////////////////////////////
+
+ParticleInformation CellPlanes::get_information(sf::Vector2i cell) const {
+    const int index = get_index(cell);
+
+    if (index == -1) {
+        return ParticleInformation();
+    }
+
+    const MaterialID material = materials[index];
+
+    ParticleInformation info;
+    info.valid_particle = true;
+    info.material_name = material_info[material].identifier;
+    info.behavior_name = behaviors[::materials[material].behavior].identifier;
+    info.temp = temps[index];
+
+    return info;
+}
+
+
+/////////////////////////////////
+// Functions for WorldSnapshot //
+/////////////////////////////////
+
+CellPlanes WorldSnapshot::get_cell_planes() const {
+    return { size, chunk_count, chunk_shift, &chunk_table, tick, materials.data(), temps.data(), shades.data(), moved_ticks.data(), chunk_stamps.data(), static_cast<int>(chunk_stamps.size()) };
+}
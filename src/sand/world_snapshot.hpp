@@ -0,0 +1,123 @@
+﻿#pragma once
+
+#include <SFML/Graphics/Color.hpp>
+
+#include <SFML/System/Vector2.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "particles.hpp"
+#include "chunk_table.hpp"
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Returns the index of a cell in planes stored chunk by chunk, -1 outside the grid 
+// \param position The grid cell {x, y}                                                    
+// \param size The size of the grid {width, height}                                        
+// \param chunk_table The slot of every chunk                                              
+// \param chunk_shift log2 of the chunk size                                               
+/////////////////////////////////////////////////////////////////////////////////////////////
+inline int get_chunked_index(sf::Vector2i position, sf::Vector2i size, const ChunkTable& chunk_table, int chunk_shift) {
+    if (position.x < 0 or position.x >= size.x or position.y < 0 or position.y >= size.y) {
+        return -1;
+    }
+
+    const int chunk_mask = (1 << chunk_shift) - 1;
+    const int slot = chunk_table.get_slot({ position.x >> chunk_shift, position.y >> chunk_shift });
+
+    return (slot << (2 * chunk_shift)) | ((position.y & chunk_mask) << chunk_shift) | (position.x & chunk_mask);
+}
+
+
+// Which chunk a slot holds and the change version of its cells, {-1, -1} for slot 0 and free slots
+struct ChunkStamp {
+    sf::Vector2i tile = { -1, -1 };
+    std::uint64_t version = 0;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// \brief Read only view of a grid of cells, stored chunk by chunk like ParticleSimulation stores them 
+// Every plane is indexed by get_index, so the cells of one chunk are contiguous                       
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+struct CellPlanes {
+	sf::Vector2i size;
+	sf::Vector2i chunk_count;
+	int chunk_shift = 0;
+	const ChunkTable* chunk_table = nullptr;
+
+	std::uint32_t tick = 0;
+
+	const MaterialID* materials = nullptr;
+	const float* temps = nullptr;
+	const std::uint8_t* shades = nullptr;
+	const std::uint32_t* moved_ticks = nullptr;
+
+	// One per slot, lets a reader tell which chunks changed since it last looked. May be null
+	const ChunkStamp* chunk_stamps = nullptr;
+	int slot_count = 0;
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns the index of a cell in the planes, -1 when it is outside the grid 
+	//////////////////////////////////////////////////////////////////////////////////////
+	int get_index(sf::Vector2i position) const {
+		return get_chunked_index(position, size, *chunk_table, chunk_shift);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	// \brief Returns information about the cell at a grid position                                   
+	// \param cell The grid cell {x, y}, cells outside the grid return an invalid ParticleInformation 
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	ParticleInformation get_information(sf::Vector2i cell) const;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// \brief A copy of the cell planes of a simulation at the end of one tick                
+// Filled by ParticleSimulation::capture, which only copies the chunks that changed since 
+// the snapshot was last filled, so a snapshot can be refilled every tick cheaply         
+////////////////////////////////////////////////////////////////////////////////////////////
+struct WorldSnapshot {
+	sf::Vector2i size;
+	sf::Vector2i chunk_count;
+	int chunk_shift = 0;
+
+	std::uint64_t seed = 0;
+	std::uint32_t tick = 0;
+	std::size_t particle_count = 0;
+
+	// One block of cells per slot, chunks without cells of their own share slot 0
+	ChunkTable chunk_table;
+	std::vector<MaterialID> materials;
+	std::vector<float> temps;
+	std::vector<std::uint8_t> shades;
+	std::vector<std::uint32_t> moved_ticks;
+	std::vector<ChunkStamp> chunk_stamps;
+
+	// Slots of the simulation change far less often than cells, so the table is only copied when they did
+	std::uint64_t table_version = 0;
+
+	// Change version of the simulation when this snapshot was filled, chunks
+	// stamped with a later version are the only ones copied on the next capture
+	std::uint64_t version = 0;
+	bool complete = false;
+
+	///////////////////////////////////////////////////////////////////////////
+	// \brief Returns a view of the copied planes that the renderer can draw 
+	///////////////////////////////////////////////////////////////////////////
+	CellPlanes get_cell_planes() const;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// \brief A rectangle of cells copied out of a simulation, stored row by row 
+// Filled by ParticleSimulation::copy_stamp and written back by paste_stamp  
+///////////////////////////////////////////////////////////////////////////////
+struct CellStamp {
+	sf::Vector2i size;
+
+	std::vector<MaterialID> materials;
+	std::vector<float> temps;
+	std::vector<std::uint8_t> shades;
+};
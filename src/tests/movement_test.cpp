@@ -0,0 +1,76 @@
+﻿#include <cstdlib>
+#include <iostream>
+#include <optional>
+
+#include "src/sand/particle_simulation.hpp"
+#include "src/sand/particles.hpp"
+
+
+// A water cell on a long rock floor. Once it slides sideways it has a heading and
+// keeps going that way, but a roll of its stay weight must still let it rest where
+// it is, like every other liquid cell. The floor is wide enough that the way ahead
+// stays free for as long as the test watches.
+
+static const sf::Vector2i size = { 1024, 8 };
+static const int floor_y = size.y - 1;
+static const int max_steps = 500;
+
+
+static std::optional<int> find_water(const ParticleSimulation& sim) {
+    const CellPlanes cells = sim.get_cell_planes();
+
+    for (int x = 0; x < size.x; x++) {
+        if (cells.materials[cells.get_index({ x, floor_y - 1 })] == MaterialID::Water) {
+            return x;
+        }
+    }
+
+    return std::nullopt;
+}
+
+
+int main() {
+    register_material_behaviors();
+    register_materials();
+    register_reactions();
+
+    ParticleSimulation sim(size, 1);
+    sim.set_multithreading(false);
+    sim.fill_rect({ 0, floor_y }, { size.x - 1, floor_y }, MaterialID::Rock);
+    sim.fill_rect({ size.x / 2, floor_y - 1 }, { size.x / 2, floor_y - 1 }, MaterialID::Water);
+
+    std::optional<int> position = find_water(sim);
+    bool sliding = false;
+    int rests = 0;
+
+    for (int step = 0; step < max_steps and position; step++) {
+        sim.update();
+
+        const std::optional<int> next = find_water(sim);
+
+        if (not next) {
+            std::cerr << "the water cell left the floor at step " << step << "\n";
+            return EXIT_FAILURE;
+        }
+
+        // Far from the walls a slide only ends by resting, nothing blocks it
+        if (*next < 32 or *next >= size.x - 32) {
+            break;
+        }
+
+        if (sliding and *next == *position) {
+            rests++;
+        }
+
+        sliding = *next != *position;
+        position = next;
+    }
+
+    if (rests == 0) {
+        std::cerr << "a sliding water cell never rested, its heading overrides its stay weight\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "movement_test passed, " << rests << " rests\n";
+    return EXIT_SUCCESS;
+}
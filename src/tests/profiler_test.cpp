@@ -0,0 +1,64 @@
+﻿#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+#include "src/profiler/profiler.hpp"
+
+
+// One thread keeps recording events while another reads them back, built with
+// -fsanitize=thread. Every name has its own duration, so an event torn between
+// two writes of the ring buffer shows up as a wrong average.
+
+static const char* names[] = { "short", "medium", "long" };
+static const std::uint64_t durations[] = { 1000, 2000, 3000 };
+
+
+int main() {
+    std::atomic<bool> stop = false;
+
+    std::thread writer([&stop] {
+        for (std::uint64_t i = 0; not stop.load(std::memory_order_relaxed); i++) {
+            const std::uint64_t begin = get_profile_time();
+            record_profile_event(names[i % 3], begin, begin + durations[i % 3]);
+        }
+    });
+
+    // Long enough for the writer to go around the ring many times while it is being read
+    const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+
+    int failures = 0;
+    int reads = 0;
+
+    for (; std::chrono::steady_clock::now() < end and failures == 0; reads++) {
+        for (const PhaseTime& phase : get_phase_times(60.0)) {
+            std::uint64_t duration = 0;
+
+            for (int i = 0; i < 3; i++) {
+                if (phase.name == names[i]) {
+                    duration = durations[i];
+                }
+            }
+
+            const double expected_ms = static_cast<double>(duration) / 1e6;
+
+            if (duration == 0 or std::abs(phase.average_ms - expected_ms) > expected_ms * 1e-7) {
+                std::cerr << "read " << reads << ": " << phase.name << " averages " << phase.average_ms << " ms over " << phase.count << " events instead of " << expected_ms << " ms\n";
+                failures++;
+            }
+        }
+    }
+
+    stop.store(true, std::memory_order_relaxed);
+    writer.join();
+
+    if (failures != 0) {
+        std::cerr << failures << " failures\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "profiler_test passed, " << reads << " reads\n";
+    return EXIT_SUCCESS;
+}
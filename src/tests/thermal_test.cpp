@@ -0,0 +1,149 @@
+﻿#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+#include "src/sand/particle_simulation.hpp"
+#include "src/sand/particles.hpp"
+
+
+static const float hot_temp = 600.f;
+static const float cold_temp = 20.f;
+
+
+// Fills the given cells with rock, at hot_temp where hot says so and cold_temp elsewhere
+static std::unique_ptr<ParticleSimulation> make_rock_world(sf::Vector2i size, const std::function<bool(sf::Vector2i)>& is_rock, const std::function<bool(sf::Vector2i)>& hot) {
+    ParticleSimulation setup(size, 1);
+
+    for (int y = 0; y < size.y; y++) {
+        for (int x = 0; x < size.x; x++) {
+            if (is_rock({ x, y })) {
+                setup.fill_rect({ x, y }, { x, y }, MaterialID::Rock);
+            }
+        }
+    }
+
+    WorldSnapshot world;
+    setup.capture(world);
+
+    const CellPlanes planes = world.get_cell_planes();
+
+    for (int y = 0; y < size.y; y++) {
+        for (int x = 0; x < size.x; x++) {
+            if (world.materials[planes.get_index({ x, y })] == MaterialID::Rock) {
+                world.temps[planes.get_index({ x, y })] = hot({ x, y }) ? hot_temp : cold_temp;
+            }
+        }
+    }
+
+    std::unique_ptr<ParticleSimulation> sim = std::make_unique<ParticleSimulation>(world);
+    sim->set_multithreading(false);
+
+    return sim;
+}
+
+
+// A rock block behind an air gap must keep its temperature while the chunk pass is on.
+// The gap is inside the chunk next to the hot slab, so that chunk touches the slab
+// but the block in it does not:
+//
+//   x   0 .. 63   64 .. 67   68 .. 71   72 .. 127
+//       hot rock  cold rock  air        cold rock
+//
+// Chunks are 32 cells wide, the one from 64 to 95 holds the gap.
+static int test_air_gap() {
+    const sf::Vector2i size = { 128, 64 };
+
+    std::unique_ptr<ParticleSimulation> sim = make_rock_world(size, [](sf::Vector2i cell) { return cell.x < 68 or cell.x >= 72; }, [](sf::Vector2i cell) { return cell.x < 64; });
+    sim->set_thermal_coarse_interval(1);
+
+    for (int i = 0; i < 200; i++) {
+        sim->update();
+    }
+
+    const CellPlanes cells = sim->get_cell_planes();
+    int failures = 0;
+
+    for (int y = 0; y < size.y; y++) {
+        for (int x = 72; x < size.x; x++) {
+            const float temp = cells.temps[cells.get_index({ x, y })];
+
+            if (temp != cold_temp) {
+                if (failures++ < 10) {
+                    std::cerr << "cell " << x << ", " << y << " behind the air gap is at " << temp << " instead of " << cold_temp << "\n";
+                }
+            }
+        }
+    }
+
+    // The rock next to the slab has to warm up, otherwise nothing was tested
+    if (cells.temps[cells.get_index({ 66, size.y / 2 })] <= cold_temp) {
+        std::cerr << "no heat reached the rock in front of the air gap\n";
+        failures++;
+    }
+
+    return failures;
+}
+
+
+// Steps until no cell of a rock slab with a hot strip along its left edge is above
+// half of hot_temp, limit + 1 if it takes longer than limit
+static int get_cooling_steps(unsigned int coarse_interval, int limit) {
+    const sf::Vector2i size = { 256, 64 };
+
+    std::unique_ptr<ParticleSimulation> sim = make_rock_world(size, [](sf::Vector2i) { return true; }, [](sf::Vector2i cell) { return cell.x < 32; });
+    sim->set_thermal_coarse_interval(coarse_interval);
+
+    for (int step = 1; step <= limit; step++) {
+        sim->update();
+
+        const CellPlanes cells = sim->get_cell_planes();
+        bool cooled = true;
+
+        for (int y = 0; y < size.y and cooled; y++) {
+            for (int x = 0; x < size.x and cooled; x++) {
+                cooled = cells.temps[cells.get_index({ x, y })] <= hot_temp / 2.f;
+            }
+        }
+
+        if (cooled) {
+            return step;
+        }
+    }
+
+    return limit + 1;
+}
+
+
+// The chunk pass is there to carry heat across large bodies faster than cell to cell
+// diffusion alone
+static int test_coarse_equilibrium() {
+    const int limit = 2000;
+
+    const int with_pass = get_cooling_steps(4, limit);
+    const int without_pass = get_cooling_steps(0, limit);
+
+    if (with_pass > limit or with_pass >= without_pass) {
+        std::cerr << "the hot strip cooled down in " << with_pass << " steps with the chunk pass and " << without_pass << " without it\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int main() {
+    register_material_behaviors();
+    register_materials();
+    register_reactions();
+
+    const int failures = test_air_gap() + test_coarse_equilibrium();
+
+    if (failures != 0) {
+        std::cerr << failures << " failures\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "thermal_test passed\n";
+    return EXIT_SUCCESS;
+}